@@ -0,0 +1,41 @@
+#ifndef BENCH_DATA_HPP
+#define BENCH_DATA_HPP
+
+#include "StructuredData.hpp"
+#include <cmath>
+#include <random>
+
+// Atariの画面に近い合成データ
+// 背景は平坦で、いくつかの小さな物体がフレームごとに少しずつ動く
+inline void fillReplayData(ReplayData &data, unsigned seed = 0) {
+  std::mt19937 engine(seed);
+  std::normal_distribution<float> normal(0, 1);
+  const int objectSize = 6;
+  const int numObjects = 4;
+
+  for (int t = 0; t < SEQ_LENGTH; t++) {
+    std::fill(data.state[t], data.state[t] + STATE_SIZE, 87);
+    for (int obj = 0; obj < numObjects; obj++) {
+      auto x = (t * (obj + 1) + obj * 17 + seed) % (84 - objectSize);
+      auto y = 10 + obj * 18;
+      for (int dy = 0; dy < objectSize; dy++) {
+        std::fill(&data.state[t][(y + dy) * 84 + x],
+                  &data.state[t][(y + dy) * 84 + x + objectSize],
+                  160 + obj * 20);
+      }
+    }
+
+    data.action[t] = engine() % ACTION_SIZE;
+    data.reward[t] = engine() % 50 == 0 ? 1 : 0;
+    data.policy[t] = 0.25 + 0.75 * (engine() % 100) / 100.0;
+    data.done[t] = false;
+  }
+  data.length = SEQ_LENGTH;
+
+  for (int i = 0; i < LSTM_STATE_SIZE; i++) {
+    data.hiddenStates[i] = std::tanh(normal(engine));
+    data.cellStates[i] = normal(engine);
+  }
+}
+
+#endif // BENCH_DATA_HPP
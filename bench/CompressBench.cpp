@@ -0,0 +1,65 @@
+#include "BenchData.hpp"
+#include "SequenceCache.hpp"
+#include "Utils.hpp"
+#include <benchmark/benchmark.h>
+
+static void BM_Compress(benchmark::State &state) {
+  auto data = std::make_unique<ReplayData>();
+  fillReplayData(*data);
+
+  for (auto _ : state) {
+    auto stored = compress(*data);
+    benchmark::DoNotOptimize(stored.ptr.get());
+  }
+  state.SetBytesProcessed(state.iterations() * sizeof(ReplayData));
+}
+BENCHMARK(BM_Compress)->Unit(benchmark::kMicrosecond);
+
+static void BM_CompressArena(benchmark::State &state) {
+  auto data = std::make_unique<ReplayData>();
+  fillReplayData(*data);
+  BlobArena arena(REPLAY_ARENA_CHUNK_SIZE * 4, REPLAY_ARENA_CHUNK_SIZE);
+  BlobArena::Writer writer(&arena);
+
+  for (auto _ : state) {
+    auto stored = compress(*data, &writer);
+    benchmark::DoNotOptimize(stored.ptr.get());
+  }
+  state.SetBytesProcessed(state.iterations() * sizeof(ReplayData));
+}
+BENCHMARK(BM_CompressArena)->Unit(benchmark::kMicrosecond);
+
+static void BM_Decompress(benchmark::State &state) {
+  auto data = std::make_unique<ReplayData>();
+  fillReplayData(*data);
+  auto stored = compress(*data);
+  auto out = std::make_unique<ReplayData>();
+
+  for (auto _ : state) {
+    decompress(stored, *out);
+    benchmark::DoNotOptimize(out->state[0][0]);
+  }
+  state.SetBytesProcessed(state.iterations() * sizeof(ReplayData));
+  state.counters["ratio"] = (double)sizeof(ReplayData) / stored.size;
+}
+BENCHMARK(BM_Decompress)->Unit(benchmark::kMicrosecond);
+
+// キャッシュに当たったときのコスト。BM_Decompressと比べる
+static void BM_SequenceCacheHit(benchmark::State &state) {
+  auto data = std::make_unique<ReplayData>();
+  fillReplayData(*data);
+  SequenceCache cache(sizeof(ReplayData) * 64, 4);
+  for (int slot = 0; slot < 64; slot++) {
+    cache.put(slot, 1, *data);
+  }
+  auto out = std::make_unique<ReplayData>();
+
+  int slot = 0;
+  for (auto _ : state) {
+    cache.get(slot, 1, *out);
+    benchmark::DoNotOptimize(out->state[0][0]);
+    slot = (slot + 1) % 64;
+  }
+  state.SetBytesProcessed(state.iterations() * sizeof(ReplayData));
+}
+BENCHMARK(BM_SequenceCacheHit)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,39 @@
+#include "BenchData.hpp"
+#include "LocalBuffer.hpp"
+#include <benchmark/benchmark.h>
+
+// 系列の区切りでの圧縮も含めた、1ステップあたりの時間
+static void BM_UpdateAndGetTransition(benchmark::State &state) {
+  torch::Device device(torch::kCPU);
+  auto stateTensor =
+      torch::zeros({1, 84, 84}, torch::TensorOptions().dtype(torch::kUInt8));
+  auto localBuffer =
+      std::make_unique<LocalBuffer>(stateTensor, NUM_ENVS, device);
+
+  auto data = std::make_unique<ReplayData>();
+  fillReplayData(*data);
+  auto request = std::make_unique<Request>();
+  request->envId = 0;
+  request->reward = 0;
+  request->done = false;
+
+  auto action = torch::zeros({1, 1}, torch::kLong);
+  auto q = torch::randn({1, 1, ACTION_SIZE});
+  auto policy = torch::rand({1, 1});
+  LstmStates lstmStates(torch::randn({1, LSTM_STATE_SIZE}),
+                        torch::randn({1, LSTM_STATE_SIZE}));
+
+  int64_t t = 0;
+  for (auto _ : state) {
+    std::copy(data->state[t % SEQ_LENGTH],
+              data->state[t % SEQ_LENGTH] + STATE_SIZE, request->state);
+    t++;
+    if (localBuffer->updateAndGetTransition(*request, action, q, lstmStates,
+                                            policy)) {
+      auto stored = localBuffer->getReplayData();
+      benchmark::DoNotOptimize(stored.data());
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UpdateAndGetTransition)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,139 @@
+#include "BenchData.hpp"
+#include "InferenceGraph.hpp"
+#include "PackedConvTrunk.hpp"
+#include "Utils.hpp"
+#include <benchmark/benchmark.h>
+
+static void BM_RetraceLoss(benchmark::State &state) {
+  torch::Device device(torch::kCPU);
+  auto backward = state.range(0) != 0;
+  auto length = 1 + TRACE_LENGTH;
+
+  auto action =
+      torch::randint(0, ACTION_SIZE, {BATCH_SIZE, length, 1}, torch::kLong);
+  auto reward = torch::rand({BATCH_SIZE, length});
+  auto done = torch::zeros({BATCH_SIZE, length}, torch::kBool);
+  auto policy = torch::rand({BATCH_SIZE, length});
+  auto onlineQ = torch::randn({BATCH_SIZE, length, ACTION_SIZE},
+                              torch::requires_grad(backward));
+  auto targetQ = torch::randn({BATCH_SIZE, length, ACTION_SIZE});
+
+  for (auto _ : state) {
+    auto ret = retraceLoss(action, reward, done, policy, onlineQ, targetQ,
+                           device, backward);
+    benchmark::DoNotOptimize(std::get<0>(ret));
+  }
+}
+BENCHMARK(BM_RetraceLoss)
+    ->ArgName("backward")
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_AgentForward(benchmark::State &state) {
+  torch::Device device(torch::kCPU);
+  auto batch = state.range(0);
+  auto seq = state.range(1);
+
+  R2D2Agent model(1, ACTION_SIZE);
+  auto x = torch::rand({batch, seq, 1, 84, 84});
+  auto prevAction = torch::randint(0, ACTION_SIZE, {batch, seq}, torch::kLong);
+  auto prevReward = torch::rand({batch, seq, 1});
+  auto hiddenStates = torch::zeros({batch, LSTM_STATE_SIZE});
+  auto cellStates = torch::zeros({batch, LSTM_STATE_SIZE});
+
+  for (auto _ : state) {
+    auto out = model.forward(x, prevAction, prevReward,
+                             LstmStates(hiddenStates, cellStates), device);
+    benchmark::DoNotOptimize(std::get<0>(out).data_ptr());
+  }
+}
+// 推論、バーンイン、訓練の形
+BENCHMARK(BM_AgentForward)
+    ->ArgNames({"batch", "seq"})
+    ->Args({1, 1})
+    ->Args({BATCH_SIZE, REPLAY_PERIOD})
+    ->Args({BATCH_SIZE, 1 + TRACE_LENGTH})
+    ->Unit(benchmark::kMillisecond);
+
+// BM_AgentForward/batch:1/seq:1と比べる
+static void BM_InferenceGraphStep(benchmark::State &state) {
+  R2D2Agent model(1, ACTION_SIZE);
+  InferenceGraph graph;
+  graph.rebuild(model);
+  auto module = graph.get();
+
+  auto x = torch::rand({1, 1, 1, 84, 84});
+  auto prevAction = torch::randint(0, ACTION_SIZE, {1, 1}, torch::kLong);
+  auto prevReward = torch::rand({1, 1, 1});
+  auto hiddenStates = torch::zeros({1, LSTM_STATE_SIZE});
+  auto cellStates = torch::zeros({1, LSTM_STATE_SIZE});
+
+  for (auto _ : state) {
+    auto out = InferenceGraph::forward(*module, x, prevAction, prevReward,
+                                       LstmStates(hiddenStates, cellStates));
+    benchmark::DoNotOptimize(std::get<0>(out).data_ptr());
+  }
+}
+BENCHMARK(BM_InferenceGraphStep)->Unit(benchmark::kMicrosecond);
+
+static void BM_InferenceGraphRebuild(benchmark::State &state) {
+  R2D2Agent model(1, ACTION_SIZE);
+  InferenceGraph graph;
+
+  for (auto _ : state) {
+    graph.rebuild(model);
+  }
+}
+BENCHMARK(BM_InferenceGraphRebuild)->Unit(benchmark::kMillisecond);
+
+// mode 0: NCHW, 1: channels-last, 2: 詰め直した重みでconv + reluを融合
+static void BM_ConvTrunk(benchmark::State &state) {
+  torch::NoGradGuard no_grad;
+  auto mode = state.range(0);
+  auto images = state.range(1);
+
+  R2D2Agent model(1, ACTION_SIZE);
+  auto x = torch::rand({images, 1, 84, 84});
+  auto module = PackedConvTrunk::build(model.trunkParams());
+
+  auto eager = [&](torch::Tensor f) {
+    f = torch::relu(model.conv1->forward(f));
+    f = torch::relu(model.conv2->forward(f));
+    f = torch::relu(model.conv3->forward(f));
+    return f.contiguous().view({f.size(0), -1});
+  };
+
+  for (auto _ : state) {
+    torch::Tensor out;
+    if (mode == 0) {
+      out = eager(x);
+    } else if (mode == 1) {
+      out = eager(x.contiguous(torch::MemoryFormat::ChannelsLast));
+    } else {
+      out = PackedConvTrunk::forward(*module, x);
+    }
+    benchmark::DoNotOptimize(out.data_ptr());
+  }
+  state.SetItemsProcessed(state.iterations() * images);
+}
+// 推論と、バーンイン（batch * REPLAY_PERIOD枚）の形
+BENCHMARK(BM_ConvTrunk)
+    ->ArgNames({"mode", "images"})
+    ->ArgsProduct({{0, 1, 2}, {1, BATCH_SIZE * REPLAY_PERIOD}})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_ToBatchedTrainData(benchmark::State &state) {
+  auto dataList = std::make_unique<std::array<ReplayData, BATCH_SIZE>>();
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    fillReplayData((*dataList)[i], i);
+  }
+  TrainData train;
+
+  for (auto _ : state) {
+    toBatchedTrainData(train, *dataList);
+    benchmark::DoNotOptimize(train.state.data_ptr());
+  }
+  state.SetBytesProcessed(state.iterations() * sizeof(*dataList));
+}
+BENCHMARK(BM_ToBatchedTrainData)->Unit(benchmark::kMillisecond);
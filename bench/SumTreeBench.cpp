@@ -0,0 +1,53 @@
+#include "SumTree.hpp"
+#include <benchmark/benchmark.h>
+#include <random>
+
+static void fill(SumTree &tree, int capacity) {
+  std::mt19937 engine(0);
+  std::uniform_real_distribution<float> dist(0.1, 1.0);
+  for (int i = 0; i < capacity; i++) {
+    tree.add(dist(engine), StoredData());
+  }
+}
+
+static void BM_SumTreeAdd(benchmark::State &state) {
+  SumTree tree(state.range(0));
+  std::mt19937 engine(0);
+  std::uniform_real_distribution<float> dist(0.1, 1.0);
+
+  for (auto _ : state) {
+    tree.add(dist(engine), StoredData());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SumTreeAdd)->RangeMultiplier(10)->Range(100000, 5000000);
+
+static void BM_SumTreeUpdate(benchmark::State &state) {
+  auto capacity = state.range(0);
+  SumTree tree(capacity);
+  fill(tree, capacity);
+  std::mt19937 engine(1);
+  std::uniform_int_distribution<int> index(0, capacity - 1);
+  std::uniform_real_distribution<float> dist(0.1, 1.0);
+
+  for (auto _ : state) {
+    tree.update(index(engine), dist(engine));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SumTreeUpdate)->RangeMultiplier(10)->Range(100000, 5000000);
+
+static void BM_SumTreeGet(benchmark::State &state) {
+  auto capacity = state.range(0);
+  SumTree tree(capacity);
+  fill(tree, capacity);
+  std::mt19937 engine(2);
+  std::uniform_real_distribution<float> dist(0.0, 1.0);
+
+  for (auto _ : state) {
+    auto ret = tree.get(dist(engine) * tree.total());
+    benchmark::DoNotOptimize(std::get<0>(ret));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SumTreeGet)->RangeMultiplier(10)->Range(100000, 5000000);
@@ -0,0 +1,216 @@
+#ifndef ACTOR_LOG_HPP
+#define ACTOR_LOG_HPP
+
+#include "Protocol.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zstd.h>
+
+// アクターから届いたデータの記録と再生
+// 接続ごとに一つのファイルで、ファイル全体が一つのzstdストリーム
+// 中身はActorLogHeaderの後に、ステップごとのActorLogRecordと、
+// 前のステップとの画面のXOR差分（STATE_SIZEバイト）が続く
+
+const char ACTOR_LOG_MAGIC[8] = {'A', 'C', 'T', 'L', 'O', 'G', '1', '\0'};
+
+struct ActorLogHeader {
+  char magic[8];
+  int32_t envId;
+} __attribute__((packed));
+
+struct ActorLogRecord {
+  int64_t time; // 記録を始めてからのナノ秒
+  float reward;
+  uint8_t done;
+} __attribute__((packed));
+
+// 環境変数ACTOR_RECORD_DIRがあれば、そこに記録する
+inline std::string actorRecordDir() {
+  auto *dir = getenv("ACTOR_RECORD_DIR");
+  return dir ? std::string(dir) : std::string();
+}
+
+// 環境変数ACTOR_REPLAY_DIRがあれば、アクターを待たずにそこの記録を再生する
+// ACTOR_REPLAY_FAST=1なら記録時の間隔を待たずに、できるだけ速く流す
+inline std::string actorReplayDir() {
+  auto *dir = getenv("ACTOR_REPLAY_DIR");
+  return dir ? std::string(dir) : std::string();
+}
+
+inline bool actorReplayFast() {
+  auto *fast = getenv("ACTOR_REPLAY_FAST");
+  return fast && atoi(fast) != 0;
+}
+
+class ActorLogWriter {
+public:
+  ActorLogWriter(const std::string &path, int envId, int64_t origin_)
+      : origin(origin_) {
+    fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) {
+      printf("failed to open %s\n", path.c_str());
+      return;
+    }
+    cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                           ACTOR_RECORD_ZSTD_LEVEL);
+    out.resize(ZSTD_CStreamOutSize());
+
+    ActorLogHeader header;
+    memcpy(header.magic, ACTOR_LOG_MAGIC, sizeof(header.magic));
+    header.envId = envId;
+    compress(&header, sizeof(header), ZSTD_e_continue);
+  }
+
+  ~ActorLogWriter() {
+    if (fp == nullptr) {
+      return;
+    }
+    compress(nullptr, 0, ZSTD_e_end);
+    fclose(fp);
+    ZSTD_freeCCtx(cctx);
+  }
+
+  ActorLogWriter(const ActorLogWriter &) = delete;
+  ActorLogWriter &operator=(const ActorLogWriter &) = delete;
+
+  // timeはsteady_clockのナノ秒
+  void write(const Request &request, int64_t time) {
+    if (fp == nullptr) {
+      return;
+    }
+    ActorLogRecord record;
+    record.time = time - origin;
+    record.reward = request.reward;
+    record.done = request.done;
+    for (int i = 0; i < STATE_SIZE; i++) {
+      delta[i] = request.state[i] ^ prev[i];
+    }
+    memcpy(prev, request.state, STATE_SIZE);
+
+    compress(&record, sizeof(record), ZSTD_e_continue);
+    compress(delta, STATE_SIZE, ZSTD_e_continue);
+
+    // 強制終了されても、ここまでは読めるようにする
+    if (++steps % ACTOR_RECORD_FLUSH_STEPS == 0) {
+      compress(nullptr, 0, ZSTD_e_flush);
+      fflush(fp);
+    }
+  }
+
+private:
+  void compress(const void *src, size_t size, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = {src, size, 0};
+    while (1) {
+      ZSTD_outBuffer output = {out.data(), out.size(), 0};
+      auto remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+      if (ZSTD_isError(remaining)) {
+        printf("failed to compress actor log(%s)\n",
+               ZSTD_getErrorName(remaining));
+        return;
+      }
+      fwrite(out.data(), 1, output.pos, fp);
+      auto done = mode == ZSTD_e_continue ? input.pos == input.size
+                                          : remaining == 0;
+      if (done) {
+        return;
+      }
+    }
+  }
+
+  FILE *fp = nullptr;
+  ZSTD_CCtx *cctx = nullptr;
+  std::vector<char> out;
+  int64_t origin;
+  int64_t steps = 0;
+  uint8_t prev[STATE_SIZE] = {};
+  uint8_t delta[STATE_SIZE];
+};
+
+class ActorLogReader {
+public:
+  explicit ActorLogReader(const std::string &path) {
+    fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr) {
+      printf("failed to open %s\n", path.c_str());
+      return;
+    }
+    dctx = ZSTD_createDCtx();
+    in.resize(ZSTD_DStreamInSize());
+
+    ActorLogHeader header;
+    if (!read(&header, sizeof(header)) ||
+        memcmp(header.magic, ACTOR_LOG_MAGIC, sizeof(header.magic)) != 0) {
+      printf("invalid actor log %s\n", path.c_str());
+      return;
+    }
+    envId_ = header.envId;
+    valid = true;
+  }
+
+  ~ActorLogReader() {
+    if (fp != nullptr) {
+      fclose(fp);
+    }
+    ZSTD_freeDCtx(dctx);
+  }
+
+  ActorLogReader(const ActorLogReader &) = delete;
+  ActorLogReader &operator=(const ActorLogReader &) = delete;
+
+  bool ok() const { return valid; }
+  int envId() const { return envId_; }
+
+  // 次のステップを読む。記録の終わり（途中で切れていればその手前）でfalse
+  bool next(Request &request, int64_t &time) {
+    ActorLogRecord record;
+    if (!valid || !read(&record, sizeof(record)) ||
+        !read(delta, STATE_SIZE)) {
+      return false;
+    }
+    request.envId = envId_;
+    for (int i = 0; i < STATE_SIZE; i++) {
+      request.state[i] = prev[i] ^ delta[i];
+    }
+    memcpy(prev, request.state, STATE_SIZE);
+    request.reward = record.reward;
+    request.done = record.done;
+    time = record.time;
+    return true;
+  }
+
+private:
+  bool read(void *dst, size_t size) {
+    ZSTD_outBuffer output = {dst, size, 0};
+    while (output.pos < output.size) {
+      if (input.pos == input.size) {
+        auto n = fread(in.data(), 1, in.size(), fp);
+        if (n == 0) {
+          return false;
+        }
+        input = {in.data(), n, 0};
+      }
+      auto ret = ZSTD_decompressStream(dctx, &output, &input);
+      if (ZSTD_isError(ret)) {
+        printf("failed to decompress actor log(%s)\n", ZSTD_getErrorName(ret));
+        return false;
+      }
+    }
+    return true;
+  }
+
+  FILE *fp = nullptr;
+  ZSTD_DCtx *dctx = nullptr;
+  std::vector<char> in;
+  ZSTD_inBuffer input = {nullptr, 0, 0};
+  bool valid = false;
+  int envId_ = 0;
+  uint8_t prev[STATE_SIZE] = {};
+  uint8_t delta[STATE_SIZE];
+};
+
+#endif // ACTOR_LOG_HPP
@@ -16,6 +16,13 @@ public:
     targetNet.detach_();
     targetNet.to(device);
   }
+
+  // モジュールのコピーはテンソルを共有する浅いコピーになる
+  // スレッドごとに持つものを共有させないよう、コピーはできないようにしておく
+  // 中身を写すときはcopyFromを使う
+  Agent(const Agent &) = delete;
+  Agent &operator=(const Agent &) = delete;
+
   R2D2Agent onlineNet;
   R2D2Agent targetNet;
 
@@ -0,0 +1,151 @@
+#ifndef BLOB_ARENA_HPP
+#define BLOB_ARENA_HPP
+
+#include "Common.hpp"
+#include "ThreadPlacement.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+#include <vector>
+
+// 圧縮済みブロブ用のリングアリーナ
+// 固定サイズのチャンクをリング順に貸し出し、チャンク内はバンプ確保する
+// リプレイの削除はほぼFIFOなので、ほとんどのチャンクはリング順に空く
+// 高報酬バッファなどが長く参照しているチャンクは飛ばして、次の空きを貸し出す
+class BlobArena {
+public:
+  BlobArena(int64_t size, int64_t chunkSize_)
+      : chunkSize(chunkSize_), numChunks(size / chunkSize_),
+        refs(size / chunkSize_) {
+    mappedSize = chunkSize * numChunks;
+    // Transparent Huge Pagesを使う
+    // MAP_HUGETLBは予約されたページが無くてもmmapが成功し、書き込んだときに
+    // SIGBUSになるので使わない
+    auto *ptr = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr != MAP_FAILED) {
+      madvise(ptr, mappedSize, MADV_HUGEPAGE);
+    }
+    if (ptr == MAP_FAILED) {
+      printf("failed to mmap blob arena(errno:%d, error_str:%s)\n", errno,
+             strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    base = static_cast<char *>(ptr);
+    // リプレイスレッドと同じNUMAノードに置く
+    bindMemoryToNode(base, mappedSize, roleNode(ThreadRole::Replay));
+  }
+
+  ~BlobArena() { munmap(base, mappedSize); }
+
+  BlobArena(const BlobArena &) = delete;
+  BlobArena &operator=(const BlobArena &) = delete;
+
+  // 使用中のチャンクのバイト数。チャンク内の隙間も含む
+  int64_t usedBytes() {
+    int64_t used = 0;
+    for (auto &ref : refs) {
+      if (ref.load() > 0) {
+        used += chunkSize;
+      }
+    }
+    return used;
+  }
+
+  // ブロブの参照を外す。参照が無くなったチャンクはacquireChunkで再利用する
+  void release(char *ptr) { refs[(ptr - base) / chunkSize].fetch_sub(1); }
+
+  // 圧縮スレッドごとに持つ書き込み位置
+  // 使用中のチャンクには書き込み側の参照が一つ付いている
+  class Writer {
+  public:
+    Writer(BlobArena *arena_) : arena(arena_) {}
+    ~Writer() {
+      if (chunk >= 0) {
+        arena->refs[chunk].fetch_sub(1);
+      }
+    }
+
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    // maxSizeまで書ける領域を返す。アリーナが一杯ならnullptr
+    char *reserve(int64_t maxSize) {
+      if (arena == nullptr) {
+        return nullptr;
+      }
+      if (chunk < 0 || offset + maxSize > arena->chunkSize) {
+        if (chunk >= 0) {
+          arena->refs[chunk].fetch_sub(1);
+        }
+        chunk = arena->acquireChunk();
+        offset = 0;
+        if (chunk < 0) {
+          return nullptr;
+        }
+      }
+      return arena->base + chunk * arena->chunkSize + offset;
+    }
+
+    // reserveした領域のうち、実際に書いたsize分を確定する
+    void commit(int64_t size) {
+      arena->refs[chunk].fetch_add(1);
+      offset += (size + 63) & ~(int64_t)63;
+    }
+
+    BlobArena *getArena() { return arena; }
+
+  private:
+    BlobArena *arena;
+    int chunk = -1;
+    int64_t offset = 0;
+  };
+
+private:
+  int acquireChunk() {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (int i = 0; i < numChunks; i++) {
+      auto chunk = head;
+      head = (head + 1) % numChunks;
+      if (refs[chunk].load() == 0) {
+        refs[chunk].store(1);
+        return chunk;
+      }
+    }
+    return -1;
+  }
+
+  char *base;
+  int64_t mappedSize;
+  int64_t chunkSize;
+  int numChunks;
+  std::vector<std::atomic<int>> refs;
+
+  std::mutex mtx;
+  int head = 0;
+};
+
+// アリーナ上のブロブならアリーナに返し、そうでなければdelete[]する
+// 最後の参照が外れたときに呼ばれる
+struct BlobDeleter {
+  BlobArena *arena = nullptr;
+
+  void operator()(char *ptr) const {
+    if (arena) {
+      arena->release(ptr);
+    } else {
+      delete[] ptr;
+    }
+  }
+};
+
+// リプレイバッファと高報酬バッファで同じブロブを共有する
+using BlobPtr = std::shared_ptr<char[]>;
+
+#endif // BLOB_ARENA_HPP
@@ -0,0 +1,20 @@
+#ifndef CACHING_CPU_ALLOCATOR_HPP
+#define CACHING_CPU_ALLOCATOR_HPP
+
+// libtorchのCPUテンソル用の、解放したブロックを使い回すアロケーター
+// 推論や学習のステップごとの一時テンソルは毎回同じ大きさなので、
+// mallocやmmapを通さずに前のステップのブロックを返す
+//
+// 小さいもの: 2のべき乗のサイズクラスごとに、スレッドごとの空きリストに置く
+//   スレッドの分が一杯なら全スレッド共通のリストに回す
+// 大きいもの: 2MB単位でmmapし、Transparent Huge Pagesを使う
+//   解放したものはサイズ順に置き、近いサイズの要求に返す
+//
+// 統計はメトリクス（cpu_alloc/...）に出す
+
+// CPU_CACHING_ALLOCATOR_ENABLEDか環境変数CPU_CACHING_ALLOCATOR=1なら、
+// libtorchのCPUアロケーターとして登録する
+// テンソルを作る前、mainの最初に呼ぶ
+void installCachingCpuAllocator();
+
+#endif // CACHING_CPU_ALLOCATOR_HPP
@@ -1,21 +1,41 @@
 #ifndef CALCULATE_GRAD_HPP
 #define CALCULATE_GRAD_HPP
 
+#include "Distributed.hpp"
+#include "ProfiledMutex.hpp"
 #include "StructuredData.hpp"
+#include "Tracer.hpp"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <torch/torch.h>
 
+// 学習スレッドの勾配を合計して、全員に同じ勾配を設定する
+// 参加するスレッドは途中で増減できる。世代ごとに、参加中のスレッドが
+// 全員足し終えたら合計を配り、全員が読み終えたら片付けて次の世代に進む
 NamedParameters gTotalGrads;
-std::array<Event, NUM_TRAIN_THREADS> gGradEvents;
-std::unordered_map<std::string, std::unique_ptr<std::mutex>> gGradLocks;
-std::mutex gGradMutex;
-int gCalculateCount = 0;
+std::unordered_map<std::string, std::unique_ptr<ProfiledMutex>> gGradLocks;
+// 以下の状態を守る
+ProfiledMutex gGradMutex("grad/barrier");
+std::condition_variable_any gGradCond;
+int gGradMembers = 0;  // 同期に参加しているスレッド
+int gGradArrived = 0;  // この世代の勾配を足し終えたスレッド
+int gGradReaders = 0;  // 前の世代の合計をまだ読んでいないスレッド
+bool gGradCompleting = false;
+int64_t gGradGeneration = 0;
+// 参加を待っているスレッドの受付番号と、許可した番号
+int64_t gGradJoinTickets = 0;
+int64_t gGradJoinGranted = 0;
+// 許可したスレッドが状態を写している間、写し元のスレッド番号
+int gGradJoinDonor = -1;
+int gGradJoinCopying = 0;
 
 void initTotalGrad(NamedParameters srcParams, torch::Device device) {
   for (auto &val : srcParams) {
     auto name = val.key();
     auto sizes = val.value().sizes();
     gTotalGrads.insert(name, torch::zeros({sizes}).to(device));
-    gGradLocks.emplace(name, std::make_unique<std::mutex>());
+    gGradLocks.emplace(name, std::make_unique<ProfiledMutex>("grad/" + name));
   }
 }
 
@@ -25,55 +45,158 @@ void clearTotalGrad() {
   }
 }
 
-void updateGrad(R2D2Agent &model, int threadNum) {
+// 集計した勾配をすべてのパラメーターに設定する
+// 途中から参加したスレッドは、まだ勾配を持っていない
+void applyTotalGrad(R2D2Agent &model) {
   auto currentParams = model.named_parameters(true /*recurse*/);
-  // すべてのパラメーター
   for (auto &gVal : gTotalGrads) {
     auto name = gVal.key();
-    auto &totalValue = gVal.value();
-    auto *t = currentParams.find(name);
-    // std::cout << threadNum << ": " << name << ": " << t->grad().sizes()
-    //           << std::endl;
-    // std::cout << totalValue.sizes() << std::endl;
-    // std::cout << (totalValue + t->grad()).sizes() << std::endl;
+    auto *currentItem = currentParams.find(name);
+    if (currentItem == nullptr) {
+      continue;
+    }
+    auto &grad = currentItem->mutable_grad();
+    if (grad.defined()) {
+      grad.index_put_({torch::indexing::Slice()}, gVal.value());
+    } else {
+      grad = gVal.value().clone();
+    }
+  }
+}
 
-    // この名前のパラメータをロックしてgradを合計に足す
-    std::lock_guard<std::mutex> lock(*gGradLocks[name]);
-    totalValue += t->grad();
+// 合計を読み終えたことを知らせ、最後のスレッドが合計をクリアする
+void finishReadGrad(std::unique_lock<ProfiledMutex> &lock) {
+  if (--gGradReaders == 0) {
+    clearTotalGrad();
+    gGradCond.notify_all();
   }
+}
 
-  int count;
-  {
-    std::lock_guard<std::mutex> lock(gGradMutex);
-    count = ++gCalculateCount;
+// 全員が足し終えた世代を締める。gGradMutexを持って呼ぶ
+// 参加待ちのスレッドがあれば、このスレッドの状態を写させてから参加させる
+void completeGeneration(std::unique_lock<ProfiledMutex> &lock, int threadNum) {
+  gGradCompleting = true;
+
+  if (gGradJoinGranted < gGradJoinTickets) {
+    auto granted = (int)(gGradJoinTickets - gGradJoinGranted);
+    gGradJoinGranted = gGradJoinTickets;
+    gGradJoinDonor = threadNum;
+    gGradJoinCopying = granted;
+    gGradCond.notify_all();
+    gGradCond.wait(lock, [&] { return gGradJoinCopying == 0; });
+    gGradJoinDonor = -1;
+    gGradMembers += granted;
   }
 
-  if (count < NUM_TRAIN_THREADS) {
-    gGradEvents[threadNum].wait();
-  } else {
-    // 他スレッド再開
-    for (int i = 0; i < NUM_TRAIN_THREADS; i++) {
-      if (i != threadNum) {
-        gGradEvents[i].set();
+  // プロセス内の合計を、さらに全プロセスで合計する
+  if (distributedWorldSize() > 1) {
+    lock.unlock();
+    {
+      TraceSpan span("train/allreduce");
+      std::vector<torch::Tensor> grads;
+      for (auto &gVal : gTotalGrads) {
+        grads.push_back(gVal.value());
       }
+      allReduceSum(grads);
+    }
+    lock.lock();
+  }
+
+  gGradArrived = 0;
+  gGradReaders = gGradMembers;
+  gGradCompleting = false;
+  gGradGeneration++;
+  gGradCond.notify_all();
+}
+
+// 世代が進むまで待つ。全員がそろっていれば、このスレッドが締める
+void waitGeneration(std::unique_lock<ProfiledMutex> &lock, int64_t generation,
+                    int threadNum) {
+  while (gGradGeneration == generation) {
+    if (!gGradCompleting && gGradArrived == gGradMembers) {
+      completeGeneration(lock, threadNum);
+    } else {
+      gGradCond.wait(lock);
+    }
+  }
+}
+
+// 同期に参加する。スレッド0は最初の参加者として、そのまま参加する
+// それ以外は次の世代の締めで、他のスレッドが止まっている間に
+// copyState(写し元のスレッド番号)で状態を写し、その世代の合計勾配を設定して戻る
+// 状態を写したらtrue
+bool joinGrad(R2D2Agent &model, int threadNum, torch::Device device,
+              const std::function<void(int)> &copyState) {
+  std::unique_lock<ProfiledMutex> lock(gGradMutex);
+  if (threadNum == 0) {
+    if (gTotalGrads.is_empty()) {
+      initTotalGrad(model.named_parameters(), device);
     }
+    gGradMembers++;
+    gGradCond.notify_all();
+    return false;
   }
 
-  // 集計した勾配をすべてのパラメーターに設定する
+  auto ticket = gGradJoinTickets++;
+  gGradCond.wait(lock, [&] {
+    return ticket < gGradJoinGranted && gGradJoinDonor >= 0;
+  });
+  auto generation = gGradGeneration;
+  lock.unlock();
+  copyState(gGradJoinDonor);
+  lock.lock();
+  gGradJoinCopying--;
+  gGradCond.notify_all();
+
+  // 締めが終わるのを待って、他のスレッドと同じ合計を読む
+  gGradCond.wait(lock, [&] { return gGradGeneration != generation; });
+  lock.unlock();
+  applyTotalGrad(model);
+  lock.lock();
+  finishReadGrad(lock);
+  return true;
+}
+
+// 同期から抜ける。前の世代の合計を読み終えてから呼ぶ
+void leaveGrad() {
+  std::lock_guard<ProfiledMutex> lock(gGradMutex);
+  gGradMembers--;
+  // 残りが全員足し終えていれば、待っているスレッドが締める
+  gGradCond.notify_all();
+}
+
+void updateGrad(R2D2Agent &model, int threadNum) {
+  std::unique_lock<ProfiledMutex> lock(gGradMutex);
+  // 前の世代の合計を全員が読み終えるまでは足さない
+  gGradCond.wait(lock, [&] { return gGradReaders == 0; });
+  auto generation = gGradGeneration;
+  lock.unlock();
+
+  auto currentParams = model.named_parameters(true /*recurse*/);
+  // すべてのパラメーター
   for (auto &gVal : gTotalGrads) {
     auto name = gVal.key();
-    auto *currentItem = currentParams.find(name);
-    if (currentItem != nullptr) {
-      currentItem->mutable_grad().index_put_({torch::indexing::Slice()},
-                                             gVal.value());
-    }
+    auto &totalValue = gVal.value();
+    auto *t = currentParams.find(name);
+
+    // この名前のパラメータをロックしてgradを合計に足す
+    std::lock_guard<ProfiledMutex> paramLock(*gGradLocks[name]);
+    totalValue += t->grad();
   }
 
-  // 全てのスレッドの勾配設定が終わったら、合計勾配値をクリアする
-  std::lock_guard<std::mutex> lock(gGradMutex);
-  if (--gCalculateCount == 0) {
-    clearTotalGrad();
+  lock.lock();
+  gGradArrived++;
+  {
+    TraceSpan span("train/grad_barrier_wait");
+    waitGeneration(lock, generation, threadNum);
   }
+  lock.unlock();
+
+  applyTotalGrad(model);
+
+  // 全てのスレッドの勾配設定が終わったら、合計勾配値をクリアする
+  lock.lock();
+  finishReadGrad(lock);
 }
 
 #endif // CALCULATE_GRAD_HPP
@@ -0,0 +1,231 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include "Agent.hpp"
+#include "TaskScheduler.hpp"
+#include <algorithm>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <unistd.h>
+
+// 訓練状態（オンライン・ターゲットネット、Adamの状態、ステップ数）の
+// チェックポイント
+// 訓練スレッドはステージング用のテンソルへコピーするだけで、
+// ファイルへの書き出しは優先度の低いタスクで行う
+class Checkpointer {
+public:
+  Checkpointer(const std::string &dir_, int keep_) : dir(dir_), keep(keep_) {
+    std::filesystem::create_directories(dir);
+  }
+
+  // 現在の状態をステージングへコピーして書き出しを依頼する
+  // 前回の書き出しが終わっていなければ今回は諦める
+  bool save(Agent &agent, torch::optim::Adam &optimizer, int stepsDone) {
+    std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+    if (!lock.owns_lock() || pending) {
+      std::cout << "checkpoint writer is busy, skip step " << stepsDone
+                << std::endl;
+      return false;
+    }
+
+    torch::NoGradGuard no_grad;
+    stage(staged.online, agent.onlineNet.named_parameters(true));
+    stage(staged.online, agent.onlineNet.named_buffers(true));
+    stage(staged.target, agent.targetNet.named_parameters(true));
+    stage(staged.target, agent.targetNet.named_buffers(true));
+
+    auto &params = optimizer.param_groups()[0].params();
+    staged.adamSteps.resize(params.size(), 0);
+    for (size_t i = 0; i < params.size(); i++) {
+      auto iter = optimizer.state().find(params[i].unsafeGetTensorImpl());
+      if (iter == optimizer.state().end()) {
+        continue;
+      }
+      auto &state =
+          static_cast<torch::optim::AdamParamState &>(*iter->second);
+      auto key = std::to_string(i);
+      stageTensor(staged.expAvg, key, state.exp_avg());
+      stageTensor(staged.expAvgSq, key, state.exp_avg_sq());
+      staged.adamSteps[i] = state.step();
+    }
+
+    staged.stepsDone = stepsDone;
+    staged.trainCount = agent.trainCount;
+    pending = true;
+    lock.unlock();
+
+    scheduler().submit(TaskPriority::Low, [this] {
+      std::lock_guard<std::mutex> lock(mtx);
+      write();
+      pending = false;
+    });
+    return true;
+  }
+
+  // 最新のチェックポイントから状態を戻す。無ければfalse
+  bool restore(Agent &agent, torch::optim::Adam &optimizer, int &stepsDone) {
+    auto files = listCheckpoints();
+    if (files.empty()) {
+      return false;
+    }
+    auto &path = files.back();
+
+    torch::serialize::InputArchive archive;
+    archive.load_from(path.string());
+    torch::NoGradGuard no_grad;
+
+    load(archive, "online/", agent.onlineNet.named_parameters(true), false);
+    load(archive, "online/", agent.onlineNet.named_buffers(true), true);
+    load(archive, "target/", agent.targetNet.named_parameters(true), false);
+    load(archive, "target/", agent.targetNet.named_buffers(true), true);
+
+    auto &params = optimizer.param_groups()[0].params();
+    for (size_t i = 0; i < params.size(); i++) {
+      auto key = std::to_string(i);
+      torch::Tensor expAvg, expAvgSq, step;
+      if (!archive.try_read("adam/" + key + "/exp_avg", expAvg)) {
+        continue;
+      }
+      archive.read("adam/" + key + "/exp_avg_sq", expAvgSq);
+      archive.read("adam/" + key + "/step", step);
+
+      auto state = std::make_unique<torch::optim::AdamParamState>();
+      state->exp_avg(expAvg.to(params[i].device()));
+      state->exp_avg_sq(expAvgSq.to(params[i].device()));
+      state->step(step.item<int64_t>());
+      optimizer.state()[params[i].unsafeGetTensorImpl()] = std::move(state);
+    }
+
+    torch::Tensor meta;
+    archive.read("meta/steps_done", meta);
+    stepsDone = meta.item<int64_t>();
+    archive.read("meta/train_count", meta);
+    agent.trainCount = meta.item<int64_t>();
+
+    std::cout << "restored " << path << ", steps = " << stepsDone
+              << std::endl;
+    return true;
+  }
+
+private:
+  using TensorMap = std::map<std::string, torch::Tensor>;
+
+  struct Staging {
+    TensorMap online;
+    TensorMap target;
+    TensorMap expAvg;
+    TensorMap expAvgSq;
+    std::vector<int64_t> adamSteps;
+    int64_t stepsDone = 0;
+    int64_t trainCount = 0;
+  };
+
+  // 初回だけ確保し、以降はコピーのみ
+  static void stageTensor(TensorMap &map, const std::string &key,
+                          const torch::Tensor &value) {
+    auto iter = map.find(key);
+    if (iter == map.end()) {
+      map.emplace(key, value.detach().to(torch::kCPU, /*non_blocking*/ false,
+                                         /*copy*/ true));
+    } else {
+      iter->second.copy_(value.detach());
+    }
+  }
+
+  static void stage(TensorMap &map, const NamedParameters &values) {
+    for (const auto &val : values) {
+      if (val.value().numel()) {
+        stageTensor(map, val.key(), val.value());
+      }
+    }
+  }
+
+  static void load(torch::serialize::InputArchive &archive,
+                   const std::string &prefix, NamedParameters values,
+                   bool isBuffer) {
+    for (auto &val : values) {
+      torch::Tensor tensor;
+      if (archive.try_read(prefix + val.key(), tensor, isBuffer)) {
+        val.value().copy_(tensor);
+      }
+    }
+  }
+
+  void write() {
+    torch::serialize::OutputArchive archive;
+    torch::serialize::OutputArchive model;
+    for (auto &[key, value] : staged.online) {
+      archive.write("online/" + key, value);
+      model.write(key, value);
+    }
+    for (auto &[key, value] : staged.target) {
+      archive.write("target/" + key, value);
+    }
+    for (auto &[key, value] : staged.expAvg) {
+      archive.write("adam/" + key + "/exp_avg", value);
+      archive.write("adam/" + key + "/exp_avg_sq", staged.expAvgSq[key]);
+      archive.write("adam/" + key + "/step",
+                    torch::tensor(staged.adamSteps[std::stoi(key)]));
+    }
+    archive.write("meta/steps_done", torch::tensor(staged.stepsDone));
+    archive.write("meta/train_count", torch::tensor(staged.trainCount));
+
+    char name[32];
+    sprintf(name, "ckpt-%09ld.pt", staged.stepsDone);
+    atomicSave(archive, dir / name);
+    // 推論側から読むためのオンラインネットのみのモデル
+    atomicSave(model, "model.pt");
+
+    auto files = listCheckpoints();
+    for (int i = 0; i + keep < (int)files.size(); i++) {
+      std::filesystem::remove(files[i]);
+    }
+  }
+
+  // 一時ファイルに書いてfsyncしてからrenameする
+  static void atomicSave(torch::serialize::OutputArchive &archive,
+                         const std::filesystem::path &path) {
+    auto tmp = path;
+    tmp += ".tmp";
+    archive.save_to(tmp.string());
+
+    auto fd = open(tmp.c_str(), O_RDONLY);
+    if (fd != -1) {
+      fsync(fd);
+      close(fd);
+    }
+    std::filesystem::rename(tmp, path);
+
+    auto parent = path.parent_path().empty() ? std::filesystem::path(".")
+                                             : path.parent_path();
+    fd = open(parent.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+
+  std::vector<std::filesystem::path> listCheckpoints() {
+    std::vector<std::filesystem::path> files;
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+      auto name = entry.path().filename().string();
+      if (name.starts_with("ckpt-") && name.ends_with(".pt")) {
+        files.push_back(entry.path());
+      }
+    }
+    // ゼロ埋めしたステップ数なので名前順がステップ順
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+
+  std::filesystem::path dir;
+  int keep;
+
+  Staging staged;
+  bool pending = false;
+  std::mutex mtx;
+};
+
+#endif // CHECKPOINT_HPP
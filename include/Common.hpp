@@ -4,10 +4,64 @@
 const auto TARGET_UPDATE = 1500;
 const auto ACTOR_UPDATE = 100;
 
+// 推論はfreezeしたTorchScriptの1ステップ分のグラフで行う（InferenceGraph.hpp）
+const auto INFERENCE_FROZEN_GRAPH = true;
+
+// 畳み込み部分をchannels-last（oneDNN）で計算する（CPUのみ）
+// 勾配の要らないforward（ターゲットネットワーク、推論）は、重みを詰め直して
+// conv + reluを融合したモジュール（PackedConvTrunk.hpp）を使う
+// 詰め直すたびにNCHWの計算と比べ、相対誤差がTOLERANCEを超えたら使わない
+const auto CONV_TRUNK_CHANNELS_LAST = false;
+const auto CONV_TRUNK_TOLERANCE = 1e-4;
+
+const auto CHECKPOINT_INTERVAL = 1000;
+const auto CHECKPOINT_DIR = "checkpoints";
+const auto CHECKPOINT_KEEP = 3;
+const auto CHECKPOINT_RESUME = true;
+
+const auto METRICS_DIR = "logs";
+const auto METRICS_FLUSH_INTERVAL = 10;
+
+// タイムライン（Tracer.hpp）。kill -USR1で記録を始め、WINDOW_SEC秒後に書き出す
+// TORCH_OPSならlibtorchの演算も同じタイムラインに入れる
+const auto TRACE_WINDOW_SEC = 10;
+const auto TRACE_BUFFER_EVENTS = 1 << 18;
+const auto TRACE_TORCH_OPS = false;
+
+// ロックの計測（ProfiledMutex.hpp）。kill -USR2か環境変数LOCK_PROFILE=1で始める
+// 計測中はDUMP_INTERVAL_SEC秒ごとに標準出力へ表示する。0なら表示しない
+const auto LOCK_PROFILE_ENABLED = false;
+const auto LOCK_PROFILE_DUMP_INTERVAL_SEC = 60;
+
+// CPUテンソル用のキャッシュするアロケーター（CachingCpuAllocator.hpp）
+// 環境変数CPU_CACHING_ALLOCATOR=1でも有効になる
+// LARGE_BYTESより大きいものはその単位でmmapし、Huge Pagesを使う
+const auto CPU_CACHING_ALLOCATOR_ENABLED = false;
+const auto CPU_ALLOC_LARGE_BYTES = 2LL << 20;
+// スレッドごと、全スレッド共通、大きいものの、それぞれ取っておく上限
+const auto CPU_ALLOC_THREAD_CACHE_BYTES = 64LL << 20;
+const auto CPU_ALLOC_SHARED_CACHE_BYTES = 1LL << 30;
+const auto CPU_ALLOC_LARGE_CACHE_BYTES = 8LL << 30;
+// 大きいものは、要求のこの倍率までの大きさのブロックを返す
+const auto CPU_ALLOC_LARGE_MAX_WASTE = 1.25;
+
+// 複数プロセスでの学習（環境変数WORLD_SIZE、RANK、MASTER_ADDR、MASTER_PORT）
+const auto DISTRIBUTED_DEFAULT_PORT = 29500;
+const auto DISTRIBUTED_TIMEOUT_MIN = 360;
+
 const auto BATCH_SIZE = 64;
 const auto LEARNING_RATE = 1e-4;
 const auto EPSILON = 1e-3;
 
+// 畳み込み・LSTM・全結合をbfloat16で計算する（CPUのみ）
+// 重み、Adamの状態、リトレースと損失はFP32のまま
+// VALIDATE_INTERVALごとに同じバッチをFP32でも計算し、損失の差を記録する
+const auto TRAIN_BF16 = false;
+const auto TRAIN_BF16_VALIDATE_INTERVAL = 100;
+
+// ターゲットネットワークの順伝播を、オンライン側と並行にinteropのスレッドで行う
+const auto TRAIN_CONCURRENT_TARGET = true;
+
 const auto REPLAY_PERIOD = 40;
 const auto TRACE_LENGTH = 80;
 const auto SEQ_LENGTH = 1 + REPLAY_PERIOD + TRACE_LENGTH;
@@ -15,7 +69,44 @@ const auto SEQ_LENGTH = 1 + REPLAY_PERIOD + TRACE_LENGTH;
 const auto MAX_REPLAY_QUEUE_SIZE = 128;
 const auto REPLAY_BUFFER_ADD_PRINT_SIZE = 500;
 const auto REPLAY_BUFFER_MIN_SIZE = 25000;
+// 件数の上限。木とデータの配列はINITIAL_SIZEから必要な分だけ広げる
 const auto REPLAY_BUFFER_SIZE = 5e6;
+const auto REPLAY_TREE_INITIAL_SIZE = 1 << 16;
+// 圧縮済みブロブのメモリ予算。超えたら古いものからリング順に捨てる。0なら件数だけで制限する
+// 環境変数REPLAY_BUFFER_BYTESで上書きできる。階層化ストレージを使うときはREPLAY_HOT_BYTESで制限する
+const auto REPLAY_BUFFER_BYTES = 32LL << 30;
+
+// リプレイの階層化ストレージ（メモリ + ディスク上のセグメントログ）
+const auto REPLAY_LOG_ENABLED = false;
+const auto REPLAY_LOG_FILE = "replay.log";
+const auto REPLAY_LOG_SEGMENT_SIZE = 1LL << 30;
+const auto REPLAY_LOG_NUM_SEGMENTS = 256;
+const auto REPLAY_HOT_BYTES = 8LL << 30;
+const auto REPLAY_HOT_PRIORITY_RATIO = 2.0;
+
+// 圧縮済みブロブを置くリングアリーナ（足りない分はヒープに確保する）
+const auto REPLAY_ARENA_SIZE = 64LL << 30;
+const auto REPLAY_ARENA_CHUNK_SIZE = 64LL << 20;
+
+// 展開済みの系列のキャッシュ（SequenceCache.hpp）。0なら使わない
+// 使うなら、例えば2LL << 30（2GiB）
+const auto REPLAY_CACHE_BYTES = 0LL;
+const auto REPLAY_CACHE_SHARDS = 16;
+
+// 別プロセスのリプレイサーバー（replay_server）の既定ポート
+// 学習側は環境変数REPLAY_SERVER=host[:port]があればそちらを使う
+const auto REPLAY_SERVER_PORT = 50100;
+
+// リモートのアクターを受け付けるTCPリスナー（FrameCodec.hpp）
+// 画面は前のステップとの差分を低いレベルのzstdで圧縮して送られてくる
+const auto REMOTE_ACTOR_ENABLED = false;
+const auto REMOTE_ACTOR_PORT = 50200;
+const auto REMOTE_ACTOR_ZSTD_LEVEL = 1;
+
+// アクターの通信の記録（ActorLog.hpp）。環境変数ACTOR_RECORD_DIRで有効になる
+// FLUSH_STEPSごとにフラッシュし、強制終了してもそこまでは再生できるようにする
+const auto ACTOR_RECORD_ZSTD_LEVEL = 3;
+const auto ACTOR_RECORD_FLUSH_STEPS = 1000;
 
 const auto RETRACE_LAMBDA = 0.95;
 const auto RESCALING_EPSILON = 1e-3;
@@ -30,7 +121,29 @@ const auto HIGH_REWARD = 2;
 
 const auto ACTION_SIZE = 4;
 const auto NUM_ENVS = 16;
+// 起動時の学習スレッド数で、専用のコアを割り当てる数
+// 学習スレッドは実行中にMAX_TRAIN_THREADSまで増減でき、超えた分は推論のコアを使う
 const auto NUM_TRAIN_THREADS = 4;
+const auto MAX_TRAIN_THREADS = 8;
+// TRAIN_ELASTIC_ENABLEDなら、TRAIN_ELASTIC_INTERVAL_SEC秒ごとに推論のステップ数を見て、
+// 1秒あたりTRAIN_ELASTIC_STEPS_PER_COREステップごとに借りたコアを一つ推論に返す
+const auto TRAIN_ELASTIC_ENABLED = false;
+const auto TRAIN_ELASTIC_INTERVAL_SEC = 10;
+const auto TRAIN_ELASTIC_STEPS_PER_CORE = 2000;
+
+// 役割ごとにコアを分けてスレッドを固定する（ThreadPlacement.hpp）
+// 学習にはコアのTRAIN_CORE_RATIOを割り当て、学習スレッドで等分する
+const auto THREAD_PLACEMENT_ENABLED = false;
+const auto PLACEMENT_TRAIN_CORE_RATIO = 0.5;
+const auto PLACEMENT_REPLAY_CORES = 1;
+const auto PLACEMENT_INFERENCE_INTRA_OP_THREADS = 1;
+// 学習スレッドごとに、ターゲット側の順伝播を一つ並行に動かせる数
+// 学習スレッドは実行中に増えるので、最大数に合わせる
+const auto PLACEMENT_INTEROP_THREADS = MAX_TRAIN_THREADS;
+
+// 展開、バッチの組み立て、優先度の計算、リプレイへの追加、
+// チェックポイントの書き出しを実行する共通のワーカー（TaskScheduler.hpp）
+const auto TASK_SCHEDULER_THREADS = 4;
 
 const auto STATE_SIZE = 84 * 84;
 const auto LSTM_STATE_SIZE = 512;
@@ -0,0 +1,23 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+#include <torch/torch.h>
+#include <vector>
+
+// 複数プロセスでのデータ並列学習
+// 環境変数WORLD_SIZEが2以上なら、RANK、MASTER_ADDR、MASTER_PORTを使って
+// Glooのプロセスグループに参加する。無ければ1プロセスとして動く
+// Glooのバックエンドは-DLEARNER_WITH_GLOO=ONでビルドしたときだけ使える
+void initDistributed();
+
+int distributedRank();
+int distributedWorldSize();
+
+// 全プロセスの値を合計して書き戻す
+// 全プロセスが同じ順番、同じ形のテンソルで呼ぶこと
+void allReduceSum(const std::vector<torch::Tensor> &tensors);
+
+// ランク0の値を全プロセスにコピーする
+void broadcastFromRank0(const std::vector<torch::Tensor> &tensors);
+
+#endif // DISTRIBUTED_HPP
@@ -0,0 +1,25 @@
+#ifndef EVENT_WRITER_HPP
+#define EVENT_WRITER_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// TensorFlowに依存せずにTensorBoardのイベントファイルを書く
+// Eventのprotobufを直接エンコードし、TFRecord形式で追記する
+class EventWriter {
+public:
+  EventWriter(const std::string &dir);
+
+  void writeScalars(const std::vector<std::pair<std::string, float>> &values,
+                    int64_t step);
+
+private:
+  void writeRecord(const std::string &data);
+
+  std::ofstream file;
+};
+
+#endif // EVENT_WRITER_HPP
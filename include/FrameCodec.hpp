@@ -0,0 +1,144 @@
+#ifndef FRAME_CODEC_HPP
+#define FRAME_CODEC_HPP
+
+#include "Protocol.hpp"
+#include "SocketIo.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/uio.h>
+#include <vector>
+#include <zstd.h>
+
+// リモートのアクター（TCP）とのやり取り
+// 接続直後にアクターがenvId(int)を送るのはinfer.sockと同じ
+// その後はステップごとにRemoteFrameHeaderと圧縮した画面を続けて送り、
+// アクション(int)を受け取る
+// 画面は前のステップとのXOR差分を、接続ごとのzstdストリームで圧縮する
+// ステップごとにフラッシュするので、前のステップまでの内容を辞書として使える
+struct RemoteFrameHeader {
+  uint32_t size; // 圧縮した画面のバイト数
+  float reward;
+  uint8_t done;
+} __attribute__((packed));
+
+class FrameEncoder {
+public:
+  explicit FrameEncoder(int level) {
+    cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    out.resize(ZSTD_compressBound(STATE_SIZE) + ZSTD_CStreamOutSize());
+  }
+  ~FrameEncoder() { ZSTD_freeCCtx(cctx); }
+  FrameEncoder(const FrameEncoder &) = delete;
+  FrameEncoder &operator=(const FrameEncoder &) = delete;
+
+  // ヘッダーと圧縮した画面を一度のsendmsgで送る
+  bool send(int fd, const uint8_t *state, float reward, bool done) {
+    for (int i = 0; i < STATE_SIZE; i++) {
+      delta[i] = state[i] ^ prev[i];
+    }
+    memcpy(prev, state, STATE_SIZE);
+
+    ZSTD_inBuffer input = {delta, STATE_SIZE, 0};
+    ZSTD_outBuffer output = {out.data(), out.size(), 0};
+    size_t remaining;
+    do {
+      remaining = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_flush);
+      if (ZSTD_isError(remaining)) {
+        printf("failed to compress frame(%s)\n",
+               ZSTD_getErrorName(remaining));
+        return false;
+      }
+      if (remaining != 0 && output.pos == output.size) {
+        out.resize(out.size() * 2);
+        output.dst = out.data();
+        output.size = out.size();
+      }
+    } while (remaining != 0);
+
+    RemoteFrameHeader header;
+    header.size = output.pos;
+    header.reward = reward;
+    header.done = done;
+
+    std::vector<struct iovec> iov = {{&header, sizeof(header)},
+                                     {out.data(), output.pos}};
+    sentBytes += sizeof(header) + output.pos;
+    return sendAllv(fd, iov);
+  }
+
+  // これまでに送ったバイト数（ヘッダーを含む）
+  uint64_t totalSentBytes() const { return sentBytes; }
+
+private:
+  ZSTD_CCtx *cctx;
+  uint64_t sentBytes = 0;
+  uint8_t prev[STATE_SIZE] = {};
+  uint8_t delta[STATE_SIZE];
+  std::vector<char> out;
+};
+
+class FrameDecoder {
+public:
+  FrameDecoder() { dctx = ZSTD_createDCtx(); }
+  ~FrameDecoder() { ZSTD_freeDCtx(dctx); }
+  FrameDecoder(const FrameDecoder &) = delete;
+  FrameDecoder &operator=(const FrameDecoder &) = delete;
+
+  // 1ステップ分を受け取り、requestのstate, reward, doneを埋める
+  // 受け取った圧縮後のバイト数をcompressedSizeに返す
+  bool recv(int fd, Request &request, size_t &compressedSize) {
+    RemoteFrameHeader header;
+    if (!recvAll(fd, &header, sizeof(header))) {
+      return false;
+    }
+    // 差分がまったく圧縮できなくても、これより大きくはならない
+    if (header.size > ZSTD_compressBound(STATE_SIZE) + ZSTD_CStreamOutSize()) {
+      printf("invalid frame size %u\n", header.size);
+      return false;
+    }
+    in.resize(header.size);
+    if (!recvAll(fd, in.data(), header.size)) {
+      return false;
+    }
+
+    ZSTD_inBuffer input = {in.data(), in.size(), 0};
+    ZSTD_outBuffer output = {delta, STATE_SIZE, 0};
+    while (input.pos < input.size) {
+      auto prevIn = input.pos;
+      auto prevOut = output.pos;
+      auto ret = ZSTD_decompressStream(dctx, &output, &input);
+      if (ZSTD_isError(ret)) {
+        printf("failed to decompress frame(%s)\n", ZSTD_getErrorName(ret));
+        return false;
+      }
+      // 1画面より多く出てくるのは壊れたデータ
+      if (input.pos == prevIn && output.pos == prevOut) {
+        printf("frame has extra data\n");
+        return false;
+      }
+    }
+    if (output.pos != STATE_SIZE) {
+      printf("invalid frame length %zu\n", output.pos);
+      return false;
+    }
+
+    for (int i = 0; i < STATE_SIZE; i++) {
+      request.state[i] = prev[i] ^ delta[i];
+    }
+    memcpy(prev, request.state, STATE_SIZE);
+    request.reward = header.reward;
+    request.done = header.done;
+    compressedSize = sizeof(header) + header.size;
+    return true;
+  }
+
+private:
+  ZSTD_DCtx *dctx;
+  uint8_t prev[STATE_SIZE] = {};
+  uint8_t delta[STATE_SIZE];
+  std::vector<char> in;
+};
+
+#endif // FRAME_CODEC_HPP
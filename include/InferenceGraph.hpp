@@ -0,0 +1,42 @@
+#ifndef INFERENCE_GRAPH_HPP
+#define INFERENCE_GRAPH_HPP
+
+#include "Models.hpp"
+#include <memory>
+#include <mutex>
+#include <torch/script.h>
+
+// 推論用の1ステップ分のTorchScriptモジュール
+// R2D2Agent::forwardのseqLen == 1の場合と同じ計算を、重みを定数にして
+// freezeし、conv + relu、linear + reluなどを融合しておく
+// 重みを公開するたびにrebuildLaterで作り直し、推論スレッドはgetで最新を使う
+class InferenceGraph {
+public:
+  void rebuild(R2D2Agent &model);
+  void rebuild(const NamedParameters &params, int64_t nActions);
+
+  // 作り直しは重いので、スケジューラーのタスクで行う
+  // 作り直している間に呼ばれたら、終わってから最後に渡されたものでもう一度作る
+  void rebuildLater(std::shared_ptr<const NamedParameters> params,
+                    int64_t nActions);
+
+  std::shared_ptr<torch::jit::Module> get() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return module;
+  }
+
+  // 入力の形はAgentInputと同じ。Q値は[batch, 1, actions]
+  static AgentOutput forward(torch::jit::Module &module, const torch::Tensor x,
+                             const torch::Tensor prevAction,
+                             const torch::Tensor prevReward,
+                             const LstmStates lstmStates);
+
+private:
+  std::mutex mtx;
+  std::shared_ptr<torch::jit::Module> module;
+  // 以下もmtxで守る
+  std::shared_ptr<const NamedParameters> pending;
+  bool rebuilding = false;
+};
+
+#endif // INFERENCE_GRAPH_HPP
@@ -1,36 +1,96 @@
 #ifndef LEARNER_HPP
 #define LEARNER_HPP
 
+#include "ActorLog.hpp"
 #include "Agent.hpp"
+#include "Checkpoint.hpp"
+#include "InferenceGraph.hpp"
 #include "LocalBuffer.hpp"
 #include "Replay.hpp"
+#include "Tracer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 const auto INVALID_ACTION = 99;
 
+// 起動時の学習スレッド数。環境変数TRAIN_THREADSがあればその数にする
+inline int initialTrainThreads() {
+  auto *threads = getenv("TRAIN_THREADS");
+  auto n = threads ? atoi(threads) : NUM_TRAIN_THREADS;
+  return std::clamp(n, 1, MAX_TRAIN_THREADS);
+}
+
+// 学習スレッドごとの状態。スレッドを増やすときに確保し、減らすときに解放する
+struct TrainWorker {
+  TrainWorker() : agent(ACTION_SIZE) {}
+
+  Agent agent;
+  std::unique_ptr<torch::optim::Adam> optimizer;
+  SampleData sampleData;
+  TrainData trainData;
+  int stepsDone = 0;
+  std::atomic<bool> stopping = false;
+  std::thread thread;
+};
+
 class Learner {
 public:
   Learner(torch::Tensor state_, int actionSize_, int numEnvs_, int traceLength,
           int replayPeriod, int capacity)
       : numEnvs(numEnvs_), actionSize(actionSize_), state(state_),
-        replay(capacity) {
+        replay(capacity, replayServerAddress()),
+        checkpointer(CHECKPOINT_DIR, CHECKPOINT_KEEP),
+        inferModel(1, ACTION_SIZE) {
+    // 推論モデルの計算グラフは切っておく
+    inferModel.detach_();
+    if (INFERENCE_FROZEN_GRAPH) {
+      inferenceGraph.rebuild(inferModel);
+    } else if (CONV_TRUNK_CHANNELS_LAST) {
+      inferModel.packTrunk();
+    }
+
+    recordDir = actorRecordDir();
+    if (!recordDir.empty()) {
+      std::filesystem::create_directories(recordDir);
+      printf("recording actors to %s\n", recordDir.c_str());
+    }
 
     inferStateSizes = std::vector<int64_t>{1, 1};
     inferStateSizes.insert(inferStateSizes.end(), state_.sizes().begin(),
                            state_.sizes().end());
 
-    for (int i = 0; i < NUM_TRAIN_THREADS; i++) {
-      trainThread[i] = std::thread(&Learner::trainLoop, this, i);
+    setTrainThreads(initialTrainThreads());
+    if (TRAIN_ELASTIC_ENABLED) {
+      std::thread(&Learner::elasticTrainLoop, this).detach();
     }
   }
 
   int listenActor();
-  int sendAndRecieveActor(int fd_other, R2D2Agent inferModel);
+  // TCPでリモートのアクターを受け付ける（REMOTE_ACTOR_ENABLEDのとき）
+  int listenRemoteActor();
+  int sendAndRecieveActor(int fd_other, R2D2Agent inferModel,
+                          bool remote = false);
+  // 記録したアクターの通信を推論とLocalBufferに流し、全て流し終えたら戻る
+  // fastなら記録時の間隔を待たない
+  void replayActorLog(const std::string &dir, bool fast);
   int inference(R2D2Agent &inferModel, Request &request, AgentInput &agentInput,
                 torch::Device device, LocalBuffer &localBuffer);
   Replay *getReplay() { return &replay; }
   void trainLoop(int threadNum);
+  // 学習スレッドをn個にする。実行中に呼んでよい
+  // 増やした分は次の勾配の同期で他のスレッドの状態を写して加わり、
+  // 減らした分は番号の大きいものから、ステップの区切りで抜ける
+  void setTrainThreads(int n);
+  // 推論のステップ数を見て、アクターが暇なら推論のコアを学習に借りる
+  void elasticTrainLoop();
 
 private:
   const int numEnvs;
@@ -41,9 +101,25 @@ private:
   int freeIndex = 1;
 
   std::vector<int64_t> inferStateSizes;
-  std::thread trainThread[NUM_TRAIN_THREADS];
+  std::array<std::unique_ptr<TrainWorker>, MAX_TRAIN_THREADS> trainWorkers;
+  std::atomic<int> numTrainThreads = 0;
+  // setTrainThreadsを一度に一つにする
+  std::mutex trainWorkersMtx;
   torch::Tensor state;
   Replay replay;
+  Checkpointer checkpointer;
+  InferenceGraph inferenceGraph;
+  // ローカルとリモートの接続で、パラメーターを共有する
+  R2D2Agent inferModel;
+
+  // アクターの通信の記録先。空なら記録しない
+  std::string recordDir;
+  const int64_t recordOrigin = traceNowNanos();
+  std::atomic<int> recordConnections = 0;
+
+  template <typename Recv, typename Send>
+  int64_t serveActor(int envId, R2D2Agent inferModel, const std::string &name,
+                     Recv recvRequest, Send sendAction);
 };
 
 #endif // LEARNER_HPP
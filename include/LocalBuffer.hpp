@@ -5,13 +5,24 @@
 #include <memory>
 #include <torch/torch.h>
 
+// 1ステップごとの値（画面以外）
+struct SequenceSteps {
+  uint8_t action[SEQ_LENGTH];
+  float reward[SEQ_LENGTH];
+  bool done[SEQ_LENGTH];
+  float policy[SEQ_LENGTH];
+  float q[SEQ_LENGTH][ACTION_SIZE];
+};
+
 class LocalBuffer {
 public:
-  LocalBuffer(torch::Tensor state_, int numEnvs, torch::Device device_)
+  LocalBuffer(torch::Tensor state_, int numEnvs, torch::Device device_,
+              BlobArena *arena = nullptr)
       : stateShape(state_.sizes()), device(device_),
         prevHiddenStates(torch::zeros({1, LSTM_STATE_SIZE})),
         prevCellStates(torch::zeros({1, LSTM_STATE_SIZE})),
-        retraceData(BATCH_SIZE, 1 + TRACE_LENGTH, ACTION_SIZE, device_) {}
+        retraceData(BATCH_SIZE, 1 + TRACE_LENGTH, ACTION_SIZE, device_),
+        arenaWriter(arena) {}
 
   RetraceData &getRetraceData() { return retraceData; }
   std::vector<StoredData> getReplayData() {
@@ -22,24 +33,43 @@ public:
   }
 
   void setInferenceParam(Request &request, AgentInput *inferData);
-  void inline setRetaceData();
+  void inline setRetaceData(int length);
+  void emitSequence(int length);
   bool updateAndGetTransition(Request &request, torch::Tensor &action,
                               torch::Tensor &q, LstmStates &lstmStates,
                               torch::Tensor &policy);
 
 private:
   torch::Device device;
-  int prevAction;
+  int prevAction = 0;
   c10::IntArrayRef stateShape;
-  Transition transition;
 
+  // 直近SEQ_LENGTHステップ分のリングバッファ
+  // 連続する系列はREPLAY_PERIODだけ重なるので、系列の先頭位置をずらせば
+  // 重なる部分を移動する必要はない
+  uint8_t stateRing[SEQ_LENGTH][STATE_SIZE];
+  SequenceSteps stepRing;
+  // 書き出し時に系列順に並べ直したもの
+  SequenceSteps sequence;
+  ReplayDataView view;
+
+  // バーンインの開始位置（系列の2番目のステップ）に入力したLSTM状態
+  // 次の系列の分は、今の系列の途中で保存しておく
+  float burnInHiddenStates[LSTM_STATE_SIZE];
+  float burnInCellStates[LSTM_STATE_SIZE];
+  float nextBurnInHiddenStates[LSTM_STATE_SIZE];
+  float nextBurnInCellStates[LSTM_STATE_SIZE];
+
+  // 現在の系列の先頭のリング上の位置
+  int start = 0;
   int index = 0;
   int retraceIndex = 0;
-  float prevReward;
+  float prevReward = 0;
   torch::Tensor prevHiddenStates;
   torch::Tensor prevCellStates;
   RetraceData retraceData;
   std::vector<StoredData> storedDatas;
+  BlobArena::Writer arenaWriter;
 };
 
 #endif // LOCAL_BUFFER_HPP
@@ -0,0 +1,158 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "EventWriter.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+const auto METRICS_SHARDS = 8;
+
+// スレッドごとのシャード番号
+inline int metricsShard() {
+  static std::atomic<int> nextShard{0};
+  thread_local int shard = nextShard.fetch_add(1) % METRICS_SHARDS;
+  return shard;
+}
+
+// スレッドごとにキャッシュラインを分けたカウンター
+class Counter {
+public:
+  void add(int64_t n = 1) {
+    shards[metricsShard()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  int64_t value() const {
+    int64_t total = 0;
+    for (auto &shard : shards) {
+      total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+private:
+  struct alignas(64) Shard {
+    std::atomic<int64_t> value{0};
+  };
+  std::array<Shard, METRICS_SHARDS> shards;
+};
+
+class Gauge {
+public:
+  void set(double v) { value_.store(v, std::memory_order_relaxed); }
+  double value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<double> value_{0};
+};
+
+// HDRヒストグラムと同じく、2のべき乗ごとにSUB_BUCKETS個へ分けた対数線形のバケット
+// 相対誤差は1 / SUB_BUCKETS以内
+class Histogram {
+public:
+  static constexpr int SUB_BITS = 3;
+  static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+  static constexpr int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  struct Snapshot {
+    std::array<int64_t, NUM_BUCKETS> counts{};
+    int64_t count = 0;
+    int64_t sum = 0;
+
+    double mean() const { return count ? (double)sum / count : 0; }
+    int64_t percentile(double p) const;
+    Snapshot operator-(const Snapshot &other) const;
+  };
+
+  void record(int64_t v) {
+    if (v < 0) {
+      v = 0;
+    }
+    auto &shard = shards[metricsShard()];
+    shard.counts[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(v, std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const;
+
+  static int bucket(uint64_t v) {
+    if (v < SUB_BUCKETS) {
+      return v;
+    }
+    int exponent = 63 - __builtin_clzll(v);
+    int sub = (v >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+  }
+
+  static int64_t lowerBound(int b) {
+    int exponent = b / SUB_BUCKETS;
+    int sub = b % SUB_BUCKETS;
+    if (exponent == 0) {
+      return sub;
+    }
+    return (int64_t)(SUB_BUCKETS + sub) << (exponent - 1);
+  }
+
+private:
+  struct alignas(64) Shard {
+    std::array<std::atomic<int64_t>, NUM_BUCKETS> counts{};
+    std::atomic<int64_t> sum{0};
+  };
+  std::array<Shard, METRICS_SHARDS> shards;
+};
+
+// 名前付きのメトリクス一覧
+// 登録時のみロックを取るので、呼び出し側はstaticな参照で保持しておく
+class Metrics {
+public:
+  Counter &counter(const std::string &name);
+  Gauge &gauge(const std::string &name);
+  Histogram &histogram(const std::string &name);
+
+  // flushのたびに書き出す前に呼ぶ。他の値から求めるゲージの更新に使う
+  void onFlush(std::function<void()> hook);
+
+  // TensorBoardのイベントファイルとPrometheus形式のテキストに書き出す
+  void flush(const std::string &dir);
+
+private:
+  std::mutex mtx;
+  std::map<std::string, std::unique_ptr<Counter>> counters;
+  std::map<std::string, std::unique_ptr<Gauge>> gauges;
+  std::map<std::string, std::unique_ptr<Histogram>> histograms;
+  std::map<std::string, Histogram::Snapshot> prevSnapshots;
+  std::vector<std::function<void()>> flushHooks;
+  std::unique_ptr<EventWriter> eventWriter;
+};
+
+Metrics &metrics();
+
+// intervalSec秒ごとにflushするスレッドを開始する
+void startMetricsReporter(const std::string &dir, int intervalSec);
+
+inline int64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// スコープの経過時間（マイクロ秒）をヒストグラムに記録する
+class ScopedTimer {
+public:
+  ScopedTimer(Histogram &histogram_)
+      : histogram(histogram_), start(nowMicros()) {}
+  ~ScopedTimer() { histogram.record(nowMicros() - start); }
+
+private:
+  Histogram &histogram;
+  int64_t start;
+};
+
+#endif // METRICS_HPP
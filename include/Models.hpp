@@ -1,6 +1,7 @@
 #ifndef MODELS_HPP
 #define MODELS_HPP
 
+#include "PackedConvTrunk.hpp"
 #include "StructuredData.hpp"
 #include <regex>
 #include <torch/torch.h>
@@ -67,6 +68,20 @@ struct Model : torch::nn::Module {
     }
   }
 
+  // パラメーターとバッファを呼び出したスレッドで確保し直す
+  // first-touchで、そのスレッドのNUMAノードのメモリになる
+  // テンソルを他のモデルと共有していると、そちらと取り合いになるので、
+  // 浅いコピーではなく自分で作ったモデルで呼ぶこと
+  void rematerialize() {
+    torch::NoGradGuard no_grad;
+    for (auto &t : this->parameters(true /*recurse*/)) {
+      t.set_data(t.clone());
+    }
+    for (auto &t : this->buffers(true /*recurse*/)) {
+      t.set_data(t.clone());
+    }
+  }
+
   void copyFrom(Model &fromModel) {
     auto newParams = fromModel.named_parameters(true /*recurse*/);
     auto newBuffers = fromModel.named_parameters(true /*recurse*/);
@@ -102,9 +117,34 @@ struct R2D2Agent : Model {
     //                                                LSTM_STATE_SIZE));
   }
 
+  // lengthsを渡すと、各系列のlengths以降のステップ（ゼロ埋め部分）は計算しない
+  // lengthsはCPUのint64で、長い順に並んでいること
   AgentOutput forward(const torch::Tensor x, const torch::Tensor prevAction,
                       const torch::Tensor prevReward,
-                      const LstmStates lstmStates, const torch::Device device);
+                      const LstmStates lstmStates, const torch::Device device,
+                      const torch::Tensor lengths = torch::Tensor());
+
+  // conv1 -> conv2 -> conv3（それぞれrelu）で、[N, 7 * 7 * 64]の特徴を返す
+  torch::Tensor convTrunk(torch::Tensor x, const torch::Device device);
+
+  std::vector<torch::Tensor> trunkParams() {
+    return {conv1->weight, conv1->bias, conv2->weight,
+            conv2->bias,   conv3->weight, conv3->bias};
+  }
+
+  // 畳み込みの重みを更新したら呼び、勾配の要らないforward用に詰め直す
+  void packTrunk() { packedTrunk->rebuild(trunkParams()); }
+
+  // 公開された重みの写しpublishedをこのモデルにコピーした後に呼ぶ
+  // 写しからタスクで詰め直すので、呼んだスレッドは待たない
+  void packTrunkLater(const NamedParameters &published) {
+    std::vector<torch::Tensor> params;
+    for (auto *name : {"conv1.weight", "conv1.bias", "conv2.weight",
+                       "conv2.bias", "conv3.weight", "conv3.bias"}) {
+      params.push_back(published[name]);
+    }
+    packedTrunk->rebuildLater(std::move(params), trunkParams());
+  }
 
   void detach_() {
     conv1->weight.detach_();
@@ -163,6 +203,9 @@ struct R2D2Agent : Model {
   torch::nn::Linear adv2{nullptr};
   torch::nn::Linear state1{nullptr};
   torch::nn::Linear state2{nullptr};
+  // コピーしたモデル同士で共有する
+  std::shared_ptr<PackedConvTrunk> packedTrunk =
+      std::make_shared<PackedConvTrunk>();
 };
 
 #endif // MODELS_HPP
@@ -0,0 +1,61 @@
+#ifndef PACKED_CONV_TRUNK_HPP
+#define PACKED_CONV_TRUNK_HPP
+
+#include <memory>
+#include <mutex>
+#include <torch/script.h>
+#include <vector>
+
+// 畳み込み部分（conv1 -> conv2 -> conv3、それぞれrelu）だけをfreezeしたモジュール
+// optimize_for_inferenceで重みはoneDNNのレイアウトに詰め直され、conv + reluは融合される
+// 作ったときの重みのバージョンを覚えておき、重みが更新されていればgetはnullptrを返す
+class PackedConvTrunk : public std::enable_shared_from_this<PackedConvTrunk> {
+public:
+  // 重みとバイアスをconv1, conv2, conv3の順に渡す
+  // 作り直したら、今の畳み込み（NCHW）と結果を比べ、差が大きければ使わない
+  void rebuild(const std::vector<torch::Tensor> &params);
+
+  // 作り直しは重いので、スケジューラーのタスクで行う
+  // paramsは書き換わらない重みの写しで、liveはそれをコピーしたモデルの重み
+  // 今のliveのバージョンで作ったものとして覚えるので、でき上がるまでにliveが
+  // 更新されていれば使われない
+  // 作り直している間に呼ばれたら、終わってから最後に渡されたものでもう一度作る
+  void rebuildLater(std::vector<torch::Tensor> params,
+                    const std::vector<torch::Tensor> &live);
+
+  // paramsが作ったときから変わっていなければ、詰め直したモジュールを返す
+  std::shared_ptr<torch::jit::Module>
+  get(const std::vector<torch::Tensor> &params);
+
+  static std::shared_ptr<torch::jit::Module>
+  build(const std::vector<torch::Tensor> &params);
+
+  // [N, C, 84, 84] -> [N, 7 * 7 * 64]
+  static torch::Tensor forward(torch::jit::Module &module,
+                               const torch::Tensor x);
+
+private:
+  struct Stamp {
+    const void *data;
+    int64_t version;
+  };
+
+  struct Pending {
+    std::vector<torch::Tensor> params;
+    std::vector<Stamp> stamps;
+  };
+
+  static std::vector<Stamp> stamp(const std::vector<torch::Tensor> &params);
+
+  void rebuild(const std::vector<torch::Tensor> &params,
+               std::vector<Stamp> current);
+
+  std::mutex mtx;
+  std::shared_ptr<torch::jit::Module> module;
+  std::vector<Stamp> stamps;
+  // 以下もmtxで守る
+  std::unique_ptr<Pending> pending;
+  bool rebuilding = false;
+};
+
+#endif // PACKED_CONV_TRUNK_HPP
@@ -0,0 +1,87 @@
+#ifndef PROFILED_MUTEX_HPP
+#define PROFILED_MUTEX_HPP
+
+#include "Metrics.hpp"
+#include "Tracer.hpp"
+#include <atomic>
+#include <mutex>
+#include <string>
+
+// どのロックで待っているかを見るための、名前付きのミューテックス
+// 計測中だけ、取得回数、競合した回数、待ち時間、保持時間を名前ごとに数える
+// 数えた値はメトリクス（lock/<名前>/...）として定期的に書き出される
+
+extern std::atomic<bool> gLockProfiling;
+
+// 同じ名前のミューテックスで共有する統計
+struct LockStats {
+  Counter &acquisitions;
+  Counter &contended;
+  Counter &waitNanos;
+  Counter &holdNanos;
+};
+
+LockStats &lockStats(const std::string &name);
+
+// 名前ごとの統計を待ち時間の長い順に表示する
+void dumpLockStats();
+
+// 環境変数LOCK_PROFILE=1かLOCK_PROFILE_ENABLEDなら計測を始める
+// SIGUSR2を受けると表示し、計測していなければ始める
+// 計測中はLOCK_PROFILE_DUMP_INTERVAL_SEC秒ごとにも表示する
+void startLockProfiler();
+
+// 計測していないときは、フラグを読むだけ
+class ProfiledMutex {
+public:
+  explicit ProfiledMutex(const std::string &name) : stats(lockStats(name)) {}
+
+  ProfiledMutex(const ProfiledMutex &) = delete;
+  ProfiledMutex &operator=(const ProfiledMutex &) = delete;
+
+  void lock() {
+    if (!gLockProfiling.load(std::memory_order_relaxed)) {
+      mtx.lock();
+      lockedAt = 0;
+      return;
+    }
+    if (mtx.try_lock()) {
+      lockedAt = traceNowNanos();
+    } else {
+      auto start = traceNowNanos();
+      mtx.lock();
+      lockedAt = traceNowNanos();
+      stats.contended.add();
+      stats.waitNanos.add(lockedAt - start);
+    }
+    stats.acquisitions.add();
+  }
+
+  bool try_lock() {
+    if (!mtx.try_lock()) {
+      return false;
+    }
+    lockedAt = 0;
+    if (gLockProfiling.load(std::memory_order_relaxed)) {
+      lockedAt = traceNowNanos();
+      stats.acquisitions.add();
+    }
+    return true;
+  }
+
+  void unlock() {
+    // 計測を始める前に取ったものは数えない
+    if (lockedAt != 0) {
+      stats.holdNanos.add(traceNowNanos() - lockedAt);
+    }
+    mtx.unlock();
+  }
+
+private:
+  std::mutex mtx;
+  LockStats &stats;
+  // 持っているスレッドだけが読み書きする
+  int64_t lockedAt = 0;
+};
+
+#endif // PROFILED_MUTEX_HPP
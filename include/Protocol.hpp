@@ -0,0 +1,25 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include "Common.hpp"
+#include <cstdint>
+#include <pwd.h>
+#include <string>
+#include <unistd.h>
+
+// アクターとのやり取り
+// 接続直後にアクターがenvId(int)を送り、その後はステップごとに
+// Requestを送ってアクション(int)を受け取る
+struct Request {
+  int envId;
+  uint8_t state[STATE_SIZE];
+  float reward;
+  bool done;
+} __attribute__((packed));
+
+inline std::string inferSocketPath() {
+  struct passwd *pw = getpwuid(getuid());
+  return std::string(pw->pw_dir) + "/infer.sock";
+}
+
+#endif // PROTOCOL_HPP
@@ -2,105 +2,165 @@
 #define REPLAY_HPP
 
 #include "ReplayBuffer.hpp"
-#include <deque>
+#include "ReplayClient.hpp"
+#include "RewardIndex.hpp"
+#include "TaskScheduler.hpp"
+#include "ThreadPlacement.hpp"
+#include "Tracer.hpp"
+#include <atomic>
 #include <future>
 #include <mutex>
 #include <numeric>
 #include <random>
 
+// 環境変数REPLAY_BUFFER_BYTESがあればそのバイト数、なければREPLAY_BUFFER_BYTES
+inline int64_t replayBudgetBytes() {
+  auto *bytes = getenv("REPLAY_BUFFER_BYTES");
+  return bytes ? atoll(bytes) : REPLAY_BUFFER_BYTES;
+}
+
 class Replay {
 public:
-  Replay(int capacity)
-      : replayBuffer(capacity), engine(rnd()), dist(0.0, 1.0),
+  // serverAddressが空でなければ、データはリプレイサーバーに置き、
+  // このプロセスでは転送だけする
+  // capacityは件数の上限で、メモリはbudgetBytesで制限する
+  Replay(int capacity, const std::string &serverAddress = "",
+         int64_t budgetBytes = replayBudgetBytes())
+      : arena(REPLAY_ARENA_SIZE, REPLAY_ARENA_CHUNK_SIZE),
+        remote(serverAddress.empty()
+                   ? nullptr
+                   : std::make_unique<ReplayClient>(serverAddress)),
+        replayBuffer(remote ? 1 : capacity), engine(rnd()), dist(0.0, 1.0),
         highRewards(HIGH_REWARD_SIZE, 0),
-        highRewardBuffer(HIGH_REWARD_BUFFER_SIZE) {
-    std::promise<void> bufferNotification;
-    replayDataFuture = bufferNotification.get_future();
+        highRewardBuffer(HIGH_REWARD_BUFFER_SIZE,
+                         "replay/high_reward_buffer") {
+    if (remote) {
+      return;
+    }
 
-    replayThread =
-        std::thread(&Replay::replayLoop, this, std::move(bufferNotification));
+    if (REPLAY_LOG_ENABLED) {
+      replayBuffer.enableLog(REPLAY_LOG_FILE, REPLAY_LOG_SEGMENT_SIZE,
+                             REPLAY_LOG_NUM_SEGMENTS, REPLAY_HOT_BYTES);
+    } else if (budgetBytes > 0) {
+      replayBuffer.enableBudget(budgetBytes);
+    }
+    if (REPLAY_CACHE_BYTES > 0) {
+      replayBuffer.enableCache(REPLAY_CACHE_BYTES, REPLAY_CACHE_SHARDS);
+    }
+
+    replayDataFuture = filledPromise.get_future();
   }
 
   void updatePriorities(std::array<int, BATCH_SIZE> &labels,
                         std::array<int, BATCH_SIZE> &indexes,
                         torch::Tensor &priorities) {
+    if (remote) {
+      remote->updatePriorities(labels, indexes, priorities);
+      return;
+    }
     for (int i = 0; i < indexes.size(); i++) {
-      if (labels[i] == REPLAY) {
-        replayBuffer.update(indexes[i], priorities.index({i}).item<float>());
-      } else {
-        highRewardBuffer.update(indexes[i],
-                                priorities.index({i}).item<float>());
-      }
+      updatePriority(labels[i], indexes[i],
+                     priorities.index({i}).item<float>());
     }
   }
 
-  void putReplayQueue(torch::Tensor priorities, std::vector<StoredData> data) {
-    if (replayQueue.size() < MAX_REPLAY_QUEUE_SIZE) {
-      replayQueue.emplace_back(
-          std::move(std::make_tuple(priorities, std::move(data))));
-      replayCond.notify_one();
+  void updatePriority(int label, int index, float priority) {
+    if (label == REPLAY) {
+      replayBuffer.update(index, priority);
+    } else {
+      highRewardBuffer.update(index, priority);
     }
   }
 
-  float median(std::vector<float> &v) {
-    size_t n = v.size() / 2;
-    nth_element(v.begin(), v.begin() + n, v.end());
-    return v[n];
+  // リプレイサーバーで、クライアントから届いた更新に使う
+  // ラベル、インデックス、優先度のどれかが不正ならfalse
+  bool updatePriorityChecked(int label, int index, float priority) {
+    if (label == REPLAY) {
+      return replayBuffer.updateChecked(index, priority);
+    }
+    if (label == HIGH_REWARD) {
+      return highRewardBuffer.updateChecked(index, priority);
+    }
+    return false;
   }
 
-  auto popReplayQueue() {
-    std::unique_lock<std::mutex> lck(replayMtx);
-    replayCond.wait(lck, [&] { return !replayQueue.empty(); });
-    auto queueData = std::move(replayQueue.front());
-    replayQueue.pop_front();
-    return queueData;
+  // 系列ができた時点で、優先度の計算を始める前に呼ぶ
+  // 追加待ちが多すぎればfalseを返し、その系列は捨てる
+  // trueを返したら、その系列についてputReplayQueueを一度だけ呼ぶ
+  bool beginInsert(int n) {
+    static auto &queueDepth = metrics().gauge("replay/queue_depth");
+    static auto &queueDrops = metrics().counter("replay/queue_drops");
+
+    if (remote) {
+      return true;
+    }
+    auto depth = pendingInserts.fetch_add(1) + 1;
+    if (depth > MAX_REPLAY_QUEUE_SIZE) {
+      pendingInserts--;
+      queueDrops.add(n);
+      return false;
+    }
+    queueDepth.set(depth);
+    return true;
   }
 
-  void addReplay() {
-    auto queueData = std::move(popReplayQueue());
+  void putReplayQueue(torch::Tensor priorities, std::vector<StoredData> data) {
+    static auto &queueDepth = metrics().gauge("replay/queue_depth");
+
+    if (remote) {
+      remote->insert(priorities, data);
+      return;
+    }
+
+    // std::functionはコピーできる必要があるので、shared_ptrで包む
+    auto dataList = std::make_shared<std::vector<StoredData>>(std::move(data));
+    scheduler().submit(TaskPriority::Normal, [this, priorities, dataList] {
+      addReplay(priorities, *dataList);
+      queueDepth.set(--pendingInserts);
+    });
+  }
+
+  // 複数のワーカーから同時に呼ばれる
+  void addReplay(torch::Tensor priorities, std::vector<StoredData> &dataList) {
+    static auto &replaySize = metrics().gauge("replay/size");
+    TraceSpan span("replay/add");
 
-    auto priorities = std::get<0>(queueData);
-    auto dataList = std::move(std::get<1>(queueData));
+    auto prios = priorities.to(torch::kCPU, torch::kFloat).contiguous();
+    auto *prioPtr = prios.data_ptr<float>();
 
     for (int i = 0; i < dataList.size(); i++) {
       auto &storeData = dataList[i];
       auto reward = storeData.reward;
-      auto size = storeData.size;
-      auto ptr = storeData.ptr.get();
-      replayBuffer.add(priorities.index({i}).item<float>(),
-                       std::move(storeData));
 
       // 遷移の報酬が高報酬リストの中央値よりも高いなら、高報酬バッファに遷移を入れる
-      const auto medVal = median(highRewards);
-      if (reward > medVal) {
+      // 高報酬リストの最小値は新しい報酬で置き換える
+      bool highReward;
+      {
+        std::lock_guard<ProfiledMutex> lock(replayMtx);
+        highReward = highRewards.offer(reward);
+      }
+      // 同じブロブを参照する。リプレイバッファで降格されても、こちらの分は残る
+      if (highReward) {
         StoredData data;
-        data.size = size;
+        data.size = storeData.size;
         data.reward = reward;
-        data.ptr = std::make_unique<char[]>(size);
-        memcpy(data.ptr.get(), ptr, size);
-        highRewardBuffer.add(priorities.index({i}).item<float>(),
-                             std::move(data));
-
-        // 高報酬リストの最小値を新しい報酬で置き換える
-        auto minIter = min_element(highRewards.begin(), highRewards.end());
-        *minIter = reward;
+        data.ptr = storeData.ptr;
+        highRewardBuffer.add(prioPtr[i], std::move(data));
       }
-    }
-  }
 
-  void replayLoop(std::promise<void> ReplayDataPromise) {
-    while (replayBuffer.get_count() < REPLAY_BUFFER_MIN_SIZE) {
-      addReplay();
+      replayBuffer.add(prioPtr[i], std::move(storeData));
     }
+    replaySize.set(replayBuffer.size());
+    reportMemory();
 
-    ReplayDataPromise.set_value();
-
-    while (1) {
-      addReplay();
+    // 学習を始められるだけ溜まったら知らせる
+    if (replayBuffer.get_count() >= REPLAY_BUFFER_MIN_SIZE) {
+      std::call_once(filledFlag, [&] { filledPromise.set_value(); });
     }
   }
 
-  void getSample(SampleData &sampleData) {
+  // バッチのうち高報酬バッファから取る数
+  int drawHighRewardCount() {
     int highRewardCount = 0;
     for (int i = 0; i < BATCH_SIZE; i++) {
       auto rand = dist(engine);
@@ -108,6 +168,11 @@ public:
         highRewardCount++;
       }
     }
+    return highRewardCount;
+  }
+
+  void getSample(SampleData &sampleData) {
+    auto highRewardCount = drawHighRewardCount();
     auto replayCount = BATCH_SIZE - highRewardCount;
 
     if (replayCount > 0) {
@@ -124,25 +189,84 @@ public:
   }
 
   void sample(SampleData &sampleData) {
+    static auto &sampleTime = metrics().histogram("replay/sample_us");
+
+    TraceSpan span("replay/sample");
+    if (remote) {
+      ScopedTimer timer(sampleTime);
+      remote->sample(sampleData);
+      return;
+    }
+
     replayDataFuture.wait();
 
+    ScopedTimer timer(sampleTime);
     getSample(sampleData);
   }
 
+  // リプレイサーバー用。getSampleと同じ配分で、圧縮済みのまま取り出す
+  void sampleBlobs(SampleBlobs &samples) {
+    static auto &sampleTime = metrics().histogram("replay/sample_us");
+
+    replayDataFuture.wait();
+
+    ScopedTimer timer(sampleTime);
+    auto highRewardCount = drawHighRewardCount();
+    auto replayCount = BATCH_SIZE - highRewardCount;
+
+    if (replayCount > 0) {
+      replayBuffer.sampleBlobs(replayCount, samples, 0);
+      samples.labelList.fill(REPLAY);
+    }
+
+    if (highRewardCount > 0) {
+      highRewardBuffer.sampleBlobs(highRewardCount, samples, replayCount);
+      for (int i = replayCount; i < BATCH_SIZE; i++) {
+        samples.labelList[i] = HIGH_REWARD;
+      }
+    }
+  }
+
+  BlobArena *getArena() { return &arena; }
+
+  // リプレイが使っているメモリの内訳
+  // ブロブは高報酬バッファと共有しているので、リプレイバッファの分だけ数える
+  void reportMemory() {
+    static auto &blobBytes = metrics().gauge("replay/memory/blob_bytes");
+    static auto &arenaBytes = metrics().gauge("replay/memory/arena_bytes");
+    static auto &indexBytes = metrics().gauge("replay/memory/index_bytes");
+    static auto &cacheBytes = metrics().gauge("replay/memory/cache_bytes");
+    static auto &totalBytes = metrics().gauge("replay/memory/total_bytes");
+
+    auto blob = replayBuffer.blobBytes();
+    auto index = replayBuffer.indexBytes() + highRewardBuffer.indexBytes();
+    auto cache = replayBuffer.cacheBytes();
+    blobBytes.set(blob);
+    arenaBytes.set(arena.usedBytes());
+    indexBytes.set(index);
+    cacheBytes.set(cache);
+    totalBytes.set(blob + index + cache);
+  }
+
+  BlobArena arena;
+  std::unique_ptr<ReplayClient> remote;
+
   std::random_device rnd;
   std::mt19937 engine;
   std::uniform_real_distribution<> dist;
 
+  std::promise<void> filledPromise;
+  std::once_flag filledFlag;
   std::future<void> replayDataFuture;
-  std::thread replayThread;
 
   ReplayBuffer replayBuffer;
   ReplayBuffer highRewardBuffer;
-  std::vector<float> highRewards;
+  RewardIndex highRewards;
+  // highRewardsを守る
+  ProfiledMutex replayMtx{"replay/high_rewards"};
 
-  std::deque<std::tuple<torch::Tensor, std::vector<StoredData>>> replayQueue;
-  std::mutex replayMtx;
-  std::condition_variable replayCond;
+  // beginInsertで受け付けて、まだ追加していないもの
+  std::atomic<int> pendingInserts{0};
 };
 
 #endif // REPLAY_HPP
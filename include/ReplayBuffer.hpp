@@ -1,25 +1,118 @@
 #ifndef REPLAY_BUFFER_HPP
 #define REPLAY_BUFFER_HPP
 
+#include "Metrics.hpp"
+#include "ProfiledMutex.hpp"
+#include "SegmentLog.hpp"
+#include "SequenceCache.hpp"
 #include "SumTree.hpp"
+#include "TaskScheduler.hpp"
+#include "Tracer.hpp"
 #include "Utils.hpp"
+#include <deque>
 #include <memory>
 #include <random>
 
 class ReplayBuffer {
 public:
-  ReplayBuffer(int capacity) : tree(SumTree(capacity)), count(0) {}
+  // nameはロックの計測で使う名前
+  ReplayBuffer(int capacity_, const std::string &name = "replay/buffer")
+      : tree(SumTree(capacity_)), capacity(capacity_), count(0), mtx(name) {}
 
   int get_count() { return count; }
 
+  // サンプリング対象として残っている数
+  int size() {
+    std::lock_guard<ProfiledMutex> lock(mtx);
+    return live;
+  }
+
+  // 新しいデータをディスク上のログに書き、メモリにはhotBytesLimitまでだけ置く
+  void enableLog(const std::string &path, int64_t segmentSize,
+                 int numSegments, int64_t hotBytes) {
+    log = std::make_unique<SegmentLog>(path, segmentSize, numSegments);
+    hotBytesLimit = hotBytes;
+  }
+
+  // 展開した系列をbytesまでメモリに取っておく
+  void enableCache(int64_t bytes, int numShards) {
+    cache = std::make_unique<SequenceCache>(bytes, numShards);
+  }
+
+  // メモリにある圧縮済みブロブの合計がbytesを超えたら、古いものから捨てる
+  // 階層化ストレージを使うときはhotBytesLimitで制限するので使わない
+  void enableBudget(int64_t bytes) { budgetBytes = bytes; }
+
+  // メモリにある圧縮済みブロブの合計バイト数
+  int64_t blobBytes() {
+    std::lock_guard<ProfiledMutex> lock(mtx);
+    return log ? hotBytes : liveBytes;
+  }
+
+  // 木、データ、世代の配列と展開済みキャッシュのバイト数
+  int64_t indexBytes() {
+    std::lock_guard<ProfiledMutex> lock(mtx);
+    return tree.memoryBytes() + generations.capacity() * sizeof(uint64_t);
+  }
+
+  int64_t cacheBytes() { return cache ? cache->memoryBytes() : 0; }
+
+  // サンプリングしてから更新までの間に捨てたスロットは、優先度0のままにする
+  // 予算を超えて捨てたもの（evictOverBudget）と、
+  // 再利用されたセグメントとともに捨てたもの（dropRecycled）のどちらも含む
   void update(int idx, float p) {
-    std::lock_guard<std::mutex> lock(mtx);
-    tree.update(idx, p);
+    std::lock_guard<ProfiledMutex> lock(mtx);
+    updateLive(idx, p);
+  }
+
+  // ネットワーク越しに届いた更新用。確保済みのスロットの範囲外か、
+  // 優先度が負や有限でなければ何もせずfalseを返す
+  bool updateChecked(int idx, float p) {
+    if (!std::isfinite(p) || p < 0) {
+      return false;
+    }
+    std::lock_guard<ProfiledMutex> lock(mtx);
+    if (idx < 0 || idx >= tree.size()) {
+      return false;
+    }
+    updateLive(idx, p);
+    return true;
   }
 
   void add(float p, StoredData data) {
-    std::lock_guard<std::mutex> lock(mtx);
+    std::lock_guard<ProfiledMutex> lock(mtx);
+    auto slot = tree.nextIndex();
+    tree.reserve(slot);
+    if (generations.size() < tree.size()) {
+      generations.resize(tree.size(), 0);
+    }
+    if (log) {
+      appendLog(data);
+    }
+
+    // 上書きされるもの。一番古いものなので、捨てる位置も一つ進める
+    auto &old = tree.at(slot);
+    if (old.size > 0) {
+      live -= 1;
+      if (!log) {
+        liveBytes -= old.size;
+      }
+      if (slot == evictTail) {
+        evictTail = (evictTail + 1) % capacity;
+      }
+    }
+    if (!log) {
+      liveBytes += data.size;
+    }
+    live += 1;
+
     tree.add(p, std::move(data));
+    generations[slot] = ++lastGeneration;
+    if (log) {
+      demoteHotData();
+    } else if (budgetBytes > 0) {
+      evictOverBudget(slot);
+    }
     count += 1;
     if (count < REPLAY_BUFFER_MIN_SIZE) {
       if (count % REPLAY_BUFFER_ADD_PRINT_SIZE == 0) {
@@ -36,35 +129,266 @@ public:
   }
 
   void sample(int n, SampleData &sampleData, int baseSize) {
+    sampleWith(n, [&](int i, float s) {
+      return load(s, sampleData.indexList[i + baseSize],
+                  sampleData.dataList[i + baseSize]);
+    });
+  }
+
+  // 展開せず、圧縮済みのままコピーして取り出す
+  void sampleBlobs(int n, SampleBlobs &samples, int baseSize) {
+    sampleWith(n, [&](int i, float s) {
+      auto &blob = samples.blobList[i + baseSize];
+      return withBlob(s, samples.indexList[i + baseSize],
+                      [&](const char *src, int size) {
+                        blob.assign(src, src + size);
+                        return true;
+                      });
+    });
+  }
+
+private:
+  // 優先度の合計をn個の区間に分け、区間ごとにloadItem(i, s)で一つ取り出す
+  // 区間ごとに別のタスクにして、展開を並列に行う
+  template <typename F> void sampleWith(int n, F loadItem) {
     std::random_device rd;
-    std::default_random_engine eng(rd());
+    auto seed = rd();
 
-    auto segment = tree.total() / n;
+    // 木の配列は追加で広がるので、ロックして読む
+    // 優先度は小数なので、合計も区間も小数のまま扱う
+    float total;
+    {
+      std::lock_guard<ProfiledMutex> lock(mtx);
+      total = tree.total();
+    }
+    auto segment = total / n;
 
-    for (auto i = 0; i < n; i++) {
+    parallelFor(n, TaskPriority::High, [&](int i) {
+      std::default_random_engine eng(seed + i);
       auto a = segment * i;
-      auto b = segment * (i + 1);
+      auto b = i == n - 1 ? total : segment * (i + 1);
+
+      std::uniform_real_distribution<float> distr(a, b);
+
+      // ログから読んでいる間にセグメントが再利用された場合は引き直す
+      bool loaded;
+      do {
+        auto s = distr(eng);
+        // 0だと左端の優先度0の葉に止まるので、少しだけ右にずらす
+        if (s <= 0) {
+          s = std::nextafter(0.0f, 1.0f);
+        }
+        loaded = loadItem(i, s);
+      } while (!loaded);
+    });
+  }
 
-      std::uniform_int_distribution<int> distr(a, b);
+  bool load(float s, int &index, ReplayData &replayData) {
+    static auto &decompressTime = metrics().histogram("replay/decompress_us");
 
-      auto s = distr(eng);
-      if (s == 0) {
-        s = 1;
+    if (!log) {
+      // ブロブの参照を持ってからロックを外すので、展開中に上書きされても解放されない
+      // 世代はデータと同じロックの中で読むので、必ずそのデータの世代になる
+      StoredData data;
+      uint64_t generation;
+      int slot;
+      {
+        std::lock_guard<ProfiledMutex> lock(mtx);
+        auto ret = tree.get(s);
+        index = std::get<0>(ret);
+        slot = index;
+        data = std::get<1>(ret);
+        generation = generations[slot];
       }
+      // 予算を超えて捨てたもの
+      if (data.size == 0) {
+        return false;
+      }
+      if (cache && cache->get(slot, generation, replayData)) {
+        return true;
+      }
+      {
+        ScopedTimer timer(decompressTime);
+        TraceSpan span("replay/decompress");
+        decompress(data, replayData);
+      }
+      if (cache) {
+        cache->put(slot, generation, replayData);
+      }
+      return true;
+    }
+
+    uint64_t generation;
+    bool hit = false;
+    auto loaded = withBlob(
+        s, index,
+        [&](const char *src, int size) {
+          // withBlobはuseを呼ぶ前に世代を入れている
+          if (cache && cache->get(index, generation, replayData)) {
+            hit = true;
+            return true;
+          }
+          ScopedTimer timer(decompressTime);
+          TraceSpan span("replay/decompress");
+          return decompress(src, size, replayData);
+        },
+        &generation);
+    if (loaded && !hit && cache) {
+      cache->put(index, generation, replayData);
+    }
+    return loaded;
+  }
+
+  // 圧縮済みのデータをuse(src, size)に渡す
+  // メモリにあるものは、降格で解放されないようにロック中に渡す
+  // ディスクにしかないものはmmap経由で読み、読み終えてから再利用されていないか確かめる
+  // generationがあれば、useを呼ぶ前にスロットの世代を入れる
+  template <typename F>
+  bool withBlob(float s, int &index, F use, uint64_t *generation = nullptr) {
+    LogLocation location;
+    int size;
+    {
+      std::lock_guard<ProfiledMutex> lock(mtx);
       auto ret = tree.get(s);
-      auto index = std::get<0>(ret);
+      index = std::get<0>(ret);
       auto &data = std::get<1>(ret);
+      if (generation) {
+        *generation = generations[index];
+      }
+      // 再利用されたセグメントにあったもの、または予算を超えて捨てたもの
+      if (data.size == 0) {
+        return false;
+      }
+      if (data.ptr || !log) {
+        return use(data.ptr.get(), data.size);
+      }
+      location = data.location;
+      size = data.size;
+    }
+
+    return use(log->read(location), size) && log->valid(location);
+  }
 
-      //(idx, p, data)
-      sampleData.indexList[i + baseSize] = index;
-      decompress(data, sampleData.dataList[i + baseSize]);
+  void updateLive(int idx, float p) {
+    if (tree.at(idx).size == 0) {
+      return;
+    }
+    tree.update(idx, p);
+  }
+
+  void appendLog(StoredData &data) {
+    auto slot = tree.nextIndex();
+    data.location = log->append(
+        slot, data.ptr.get(), data.size,
+        [&](int recycledSlot, const LogLocation &location) {
+          dropRecycled(recycledSlot, location);
+        });
+
+    // 上書きされるデータがメモリにあれば、その分を減らす
+    auto &old = tree.at(slot);
+    if (old.ptr) {
+      hotBytes -= old.size;
+    }
+
+    hotSlots.emplace_back(slot, data.location);
+    hotBytes += data.size;
+  }
+
+  // 再利用されるセグメントにまだ残っているデータは、サンプリング対象から外す
+  // sizeを0にしておけば、あとから届いた優先度の更新はupdateで無視される
+  void dropRecycled(int slot, const LogLocation &location) {
+    auto &data = tree.at(slot);
+    if (data.location != location) {
+      return;
+    }
+    if (data.ptr) {
+      hotBytes -= data.size;
+      data.ptr.reset();
+    }
+    data.size = 0;
+    data.location = LogLocation();
+    live -= 1;
+    tree.update(slot, 0);
+    generations[slot] = ++lastGeneration;
+  }
+
+  // 予算を超えている間、一番古いものからリング順に捨てる
+  // 追加したばかりのnewestは残す
+  void evictOverBudget(int newest) {
+    static auto &evictions = metrics().counter("replay/evictions");
+
+    while (liveBytes > budgetBytes && evictTail != newest) {
+      auto &data = tree.at(evictTail);
+      if (data.size > 0) {
+        liveBytes -= data.size;
+        live -= 1;
+        data.ptr.reset();
+        data.size = 0;
+        tree.update(evictTail, 0);
+        generations[evictTail] = ++lastGeneration;
+        evictions.add();
+      }
+      evictTail = (evictTail + 1) % capacity;
+    }
+  }
+
+  // メモリ上限を超えたら古いものからディスクのみに降格する
+  // 優先度が平均より十分高いものは一度だけ見逃す
+  void demoteHotData() {
+    // 上書きされたものは先頭に溜まるので取り除いておく
+    while (!hotSlots.empty() &&
+           tree.at(hotSlots.front().first).location !=
+               hotSlots.front().second) {
+      hotSlots.pop_front();
+    }
+
+    auto threshold =
+        REPLAY_HOT_PRIORITY_RATIO * tree.total() / std::max(live, 1);
+    auto reprieves = hotSlots.size();
+
+    while (hotBytes > hotBytesLimit && !hotSlots.empty()) {
+      auto [slot, location] = hotSlots.front();
+      hotSlots.pop_front();
+
+      auto &data = tree.at(slot);
+      // 上書き済み、または破棄済み
+      if (data.location != location || !data.ptr) {
+        continue;
+      }
+
+      if (reprieves > 0 && tree.priority(slot) > threshold) {
+        reprieves--;
+        hotSlots.emplace_back(slot, location);
+        continue;
+      }
+
+      data.ptr.reset();
+      hotBytes -= data.size;
     }
   }
 
-private:
   SumTree tree;
+  int capacity;
   int count;
-  std::mutex mtx;
+  ProfiledMutex mtx;
+
+  // 以下もmtxで守る
+  // サンプリング対象として残っている数と、そのメモリ上のブロブの合計（ログなしのとき）
+  int live = 0;
+  int64_t liveBytes = 0;
+  int64_t budgetBytes = 0;
+  // 残っているもののうち一番古い位置
+  int evictTail = 0;
+
+  std::unique_ptr<SegmentLog> log;
+  std::deque<std::pair<int, LogLocation>> hotSlots;
+  int64_t hotBytes = 0;
+  int64_t hotBytesLimit = 0;
+
+  // スロットごとの、最後に書き込んだときの世代。木と一緒に広げる。mtxで守る
+  std::vector<uint64_t> generations;
+  uint64_t lastGeneration = 0;
+  std::unique_ptr<SequenceCache> cache;
 };
 
 #endif // REPLAY_BUFFER_HPP
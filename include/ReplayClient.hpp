@@ -0,0 +1,47 @@
+#ifndef REPLAY_CLIENT_HPP
+#define REPLAY_CLIENT_HPP
+
+#include "ReplayProtocol.hpp"
+#include "StructuredData.hpp"
+#include <mutex>
+#include <string>
+#include <torch/torch.h>
+#include <vector>
+
+// 別プロセスのリプレイサーバーにつなぐクライアント
+// 呼び出し元のスレッドごとに接続をプールから貸し出す
+class ReplayClient {
+public:
+  // address: host[:port]
+  ReplayClient(const std::string &address);
+  ~ReplayClient();
+
+  ReplayClient(const ReplayClient &) = delete;
+  ReplayClient &operator=(const ReplayClient &) = delete;
+
+  // 送りっぱなし。送れなければそのバッチは捨てる
+  void insert(const torch::Tensor &priorities,
+              const std::vector<StoredData> &dataList);
+
+  // サーバーにつながるまで待つ
+  void sample(SampleData &sampleData);
+
+  void updatePriorities(std::array<int, BATCH_SIZE> &labels,
+                        std::array<int, BATCH_SIZE> &indexes,
+                        torch::Tensor &priorities);
+
+private:
+  int connectServer();
+  int acquire();
+  // okがfalseなら、途中まで送受信した接続なので捨てる
+  void release(int fd, bool ok);
+  bool trySample(int fd, SampleData &sampleData);
+
+  std::string host;
+  std::string port;
+
+  std::mutex mtx;
+  std::vector<int> idleFds;
+};
+
+#endif // REPLAY_CLIENT_HPP
@@ -0,0 +1,57 @@
+#ifndef REPLAY_PROTOCOL_HPP
+#define REPLAY_PROTOCOL_HPP
+
+#include "Common.hpp"
+#include "SocketIo.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+// リプレイサーバーとのやり取り
+// どのメッセージもReplayMessageHeaderの後に、count個の項目と、
+// 項目の順に並べた圧縮済みブロブが続く
+//
+// INSERT:            InsertItem[count] + ブロブ。返信なし
+// SAMPLE:            項目なし。返信はSAMPLE + SampleItem[count] + ブロブ
+// UPDATE_PRIORITIES: PriorityItem[count]。返信なし
+//
+// 返信が無いメッセージは送りっぱなしで、同じ接続上の順序だけを前提にする
+enum ReplayOp : uint32_t {
+  REPLAY_OP_INSERT = 1,
+  REPLAY_OP_SAMPLE = 2,
+  REPLAY_OP_UPDATE_PRIORITIES = 3,
+};
+
+struct ReplayMessageHeader {
+  uint32_t op;
+  uint32_t count;
+} __attribute__((packed));
+
+struct InsertItem {
+  float priority;
+  float reward;
+  int32_t size;
+} __attribute__((packed));
+
+struct SampleItem {
+  int32_t index;
+  int32_t label;
+  int32_t size;
+} __attribute__((packed));
+
+struct PriorityItem {
+  int32_t index;
+  int32_t label;
+  float priority;
+} __attribute__((packed));
+
+// 一度に受け付ける項目数の上限
+const auto REPLAY_MAX_ITEMS = 4096;
+
+// 環境変数REPLAY_SERVER=host[:port]。無ければ空で、リプレイはプロセス内に置く
+inline std::string replayServerAddress() {
+  auto *addr = getenv("REPLAY_SERVER");
+  return addr ? std::string(addr) : std::string();
+}
+
+#endif // REPLAY_PROTOCOL_HPP
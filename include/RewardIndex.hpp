@@ -0,0 +1,50 @@
+#ifndef REWARD_INDEX_HPP
+#define REWARD_INDEX_HPP
+
+#include <iterator>
+#include <set>
+
+// 高報酬リスト
+// 大きさを保ったまま、中央値より高い報酬が来たら最小値と入れ替える
+// 並べたままにしておき、中央値の位置を指すイテレーターを入れ替えのたびに
+// ずらすので、中央値は定数時間、入れ替えはO(log K)
+class RewardIndex {
+public:
+  RewardIndex(int size, float initial) {
+    for (int i = 0; i < size; i++) {
+      rewards.insert(initial);
+    }
+    mid = std::next(rewards.begin(), rewards.size() / 2);
+  }
+
+  // 昇順でsize / 2番目
+  float median() const { return *mid; }
+
+  float min() const { return *rewards.begin(); }
+
+  // rewardが中央値より高ければ最小値と入れ替えてtrue
+  bool offer(float reward) {
+    if (!(reward > *mid)) {
+      return false;
+    }
+    if (rewards.size() < 2) {
+      rewards.erase(rewards.begin());
+      rewards.insert(reward);
+      mid = rewards.begin();
+      return true;
+    }
+
+    // 最小値を消すと中央値は一つ前の位置になり、
+    // 中央値より高い報酬は中央値より後ろに入るので、一つ進めれば戻る
+    rewards.erase(rewards.begin());
+    rewards.insert(reward);
+    ++mid;
+    return true;
+  }
+
+private:
+  std::multiset<float> rewards;
+  std::multiset<float>::iterator mid;
+};
+
+#endif // REWARD_INDEX_HPP
@@ -0,0 +1,138 @@
+#ifndef SEGMENT_LOG_HPP
+#define SEGMENT_LOG_HPP
+
+#include "StructuredData.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <string>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+#include <zstd.h>
+
+// 圧縮済みの遷移データを追記していく、ディスク上のセグメントログ
+// 書き込みはpwritevでシーケンシャルに行い、読み出しはmmap経由で行う
+// 書き込みカーソルはセグメントをリングとして一周し、再利用するセグメントの
+// 中身は破棄される
+class SegmentLog {
+public:
+  using RecycleCallback = std::function<void(int, const LogLocation &)>;
+
+  SegmentLog(const std::string &path, int64_t segmentSize_, int numSegments_)
+      : segmentSize(segmentSize_), numSegments(numSegments_),
+        generations(numSegments_), ends(numSegments_, 0) {
+    if (segmentSize < (int64_t)(ZSTD_COMPRESSBOUND(sizeof(ReplayData)) +
+                                sizeof(Header))) {
+      printf("segment size %ld is too small\n", segmentSize);
+      exit(EXIT_FAILURE);
+    }
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      printf("failed to open %s(errno:%d, error_str:%s)\n", path.c_str(),
+             errno, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    fileSize = segmentSize * numSegments;
+    if (ftruncate(fd, fileSize) == -1) {
+      printf("failed to ftruncate(errno:%d, error_str:%s)\n", errno,
+             strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    base = static_cast<char *>(
+        mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0));
+    if (base == MAP_FAILED) {
+      printf("failed to mmap(errno:%d, error_str:%s)\n", errno,
+             strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    // サンプリングはランダムアクセスなので先読みさせない
+    madvise(base, fileSize, MADV_RANDOM);
+  }
+
+  ~SegmentLog() {
+    munmap(base, fileSize);
+    close(fd);
+  }
+
+  SegmentLog(const SegmentLog &) = delete;
+  SegmentLog &operator=(const SegmentLog &) = delete;
+
+  // ブロブを末尾に追記して、その位置を返す
+  // セグメントを再利用する場合は、そこにあったレコードごとにonRecycleを呼ぶ
+  LogLocation append(int slot, const char *data, int size,
+                     const RecycleCallback &onRecycle) {
+    auto recordSize = align(sizeof(Header) + size);
+    if (cursor + recordSize > segmentSize) {
+      current = (current + 1) % numSegments;
+      cursor = 0;
+      recycle(current, onRecycle);
+    }
+
+    Header header{slot, size};
+    struct iovec iov[2] = {{&header, sizeof(header)},
+                           {const_cast<char *>(data), (size_t)size}};
+    auto offset = current * segmentSize + cursor;
+    if (pwritev(fd, iov, 2, offset) == -1) {
+      printf("failed to pwritev(errno:%d, error_str:%s)\n", errno,
+             strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    LogLocation location{current, cursor + (int64_t)sizeof(Header),
+                         generations[current].load()};
+    cursor += recordSize;
+    ends[current] = cursor;
+    return location;
+  }
+
+  const char *read(const LogLocation &location) const {
+    return base + location.segment * segmentSize + location.offset;
+  }
+
+  // 読み出し後に呼び、その間にセグメントが再利用されていないか確認する
+  bool valid(const LogLocation &location) const {
+    return location.segment >= 0 &&
+           generations[location.segment].load() == location.generation;
+  }
+
+private:
+  struct Header {
+    int slot;
+    int size;
+  };
+
+  static int64_t align(int64_t size) { return (size + 7) & ~(int64_t)7; }
+
+  void recycle(int segment, const RecycleCallback &onRecycle) {
+    auto *segmentBase = base + segment * segmentSize;
+    for (int64_t pos = 0; pos < ends[segment];) {
+      Header header;
+      memcpy(&header, segmentBase + pos, sizeof(header));
+      onRecycle(header.slot, LogLocation{segment, pos + (int64_t)sizeof(Header),
+                                         generations[segment].load()});
+      pos += align(sizeof(Header) + header.size);
+    }
+    generations[segment]++;
+    ends[segment] = 0;
+  }
+
+  int fd = -1;
+  char *base = nullptr;
+  int64_t fileSize;
+  int64_t segmentSize;
+  int numSegments;
+
+  int current = 0;
+  int64_t cursor = 0;
+  std::vector<std::atomic<uint64_t>> generations;
+  std::vector<int64_t> ends;
+};
+
+#endif // SEGMENT_LOG_HPP
@@ -0,0 +1,139 @@
+#ifndef SEQUENCE_CACHE_HPP
+#define SEQUENCE_CACHE_HPP
+
+#include "Metrics.hpp"
+#include "StructuredData.hpp"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// 展開済みの系列のキャッシュ
+// 優先度の高い系列は何度もサンプリングされるので、展開した結果を取っておく
+// スロットでシャードに分けてロックし、いっぱいになったらCLOCKで追い出す
+// スロットに書き込むたびに進む世代と一緒に持ち、上書きされたものは返さない
+class SequenceCache {
+public:
+  SequenceCache(int64_t bytes, int numShards)
+      : shardCapacity(std::max<int64_t>(
+            1, bytes / (int64_t)sizeof(ReplayData) / numShards)),
+        shards(numShards) {
+    // ヒット率は引くたびには計算せず、書き出すときに求める
+    static std::once_flag hitRateFlag;
+    std::call_once(hitRateFlag, [] {
+      metrics().onFlush([] {
+        static auto &hits = metrics().counter("replay/cache/hits");
+        static auto &misses = metrics().counter("replay/cache/misses");
+        static auto &hitRate = metrics().gauge("replay/cache/hit_rate");
+        auto total = hits.value() + misses.value();
+        if (total > 0) {
+          hitRate.set((double)hits.value() / total);
+        }
+      });
+    });
+  }
+
+  // 同じ世代のものがあればoutにコピーしてtrue
+  bool get(int slot, uint64_t generation, ReplayData &out) {
+    static auto &hits = metrics().counter("replay/cache/hits");
+    static auto &misses = metrics().counter("replay/cache/misses");
+
+    auto &shard = shardOf(slot);
+    bool hit = false;
+    {
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      auto iter = shard.index.find(slot);
+      if (iter != shard.index.end()) {
+        auto &entry = shard.entries[iter->second];
+        if (entry.generation == generation) {
+          memcpy(&out, entry.data.get(), sizeof(ReplayData));
+          entry.referenced = true;
+          hit = true;
+        }
+      }
+    }
+
+    (hit ? hits : misses).add();
+    return hit;
+  }
+
+  void put(int slot, uint64_t generation, const ReplayData &data) {
+    static auto &evictions = metrics().counter("replay/cache/evictions");
+
+    auto &shard = shardOf(slot);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+
+    // 古い世代のものは、その場で置き換える
+    // 展開している間に上書きされたスロットなら、新しい世代のものを残す
+    auto iter = shard.index.find(slot);
+    if (iter != shard.index.end()) {
+      auto &entry = shard.entries[iter->second];
+      if (entry.generation > generation) {
+        return;
+      }
+      memcpy(entry.data.get(), &data, sizeof(ReplayData));
+      entry.generation = generation;
+      entry.referenced = true;
+      return;
+    }
+
+    int position;
+    if ((int64_t)shard.entries.size() < shardCapacity) {
+      position = shard.entries.size();
+      shard.entries.emplace_back();
+      shard.entries.back().data = std::make_unique<ReplayData>();
+    } else {
+      // 最近使われていないものが見つかるまで針を進める
+      while (shard.entries[shard.hand].referenced) {
+        shard.entries[shard.hand].referenced = false;
+        shard.hand = (shard.hand + 1) % shard.entries.size();
+      }
+      position = shard.hand;
+      shard.hand = (shard.hand + 1) % shard.entries.size();
+      shard.index.erase(shard.entries[position].slot);
+      evictions.add();
+    }
+
+    // 追い出したものの領域を使い回す
+    auto &entry = shard.entries[position];
+    memcpy(entry.data.get(), &data, sizeof(ReplayData));
+    entry.slot = slot;
+    entry.generation = generation;
+    entry.referenced = false;
+    shard.index[slot] = position;
+  }
+
+  // 確保済みの系列の領域のバイト数
+  int64_t memoryBytes() {
+    int64_t entries = 0;
+    for (auto &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      entries += shard.entries.size();
+    }
+    return entries * (int64_t)sizeof(ReplayData);
+  }
+
+private:
+  struct Entry {
+    int slot = -1;
+    uint64_t generation = 0;
+    bool referenced = false;
+    std::unique_ptr<ReplayData> data;
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mtx;
+    std::unordered_map<int, int> index;
+    std::vector<Entry> entries;
+    int hand = 0;
+  };
+
+  Shard &shardOf(int slot) { return shards[slot % shards.size()]; }
+
+  int64_t shardCapacity;
+  std::vector<Shard> shards;
+};
+
+#endif // SEQUENCE_CACHE_HPP
@@ -0,0 +1,72 @@
+#ifndef SOCKET_IO_HPP
+#define SOCKET_IO_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+
+// ストリームソケットで、指定したバイト数を送り切る・受け取り切る
+inline bool sendAll(int fd, const void *buf, size_t len) {
+  auto *ptr = static_cast<const char *>(buf);
+  while (len > 0) {
+    auto size = send(fd, ptr, len, MSG_NOSIGNAL);
+    if (size <= 0) {
+      if (size < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    ptr += size;
+    len -= size;
+  }
+  return true;
+}
+
+inline bool recvAll(int fd, void *buf, size_t len) {
+  auto *ptr = static_cast<char *>(buf);
+  while (len > 0) {
+    auto size = recv(fd, ptr, len, 0);
+    if (size <= 0) {
+      if (size < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    ptr += size;
+    len -= size;
+  }
+  return true;
+}
+
+// iovecをまとめて送る。ブロブはコピーせずにそのままカーネルへ渡す
+inline bool sendAllv(int fd, std::vector<struct iovec> &iov) {
+  size_t index = 0;
+  while (index < iov.size()) {
+    struct msghdr msg = {};
+    msg.msg_iov = &iov[index];
+    msg.msg_iovlen = std::min<size_t>(iov.size() - index, IOV_MAX);
+    auto size = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    // 送れた分だけ進める
+    while (index < iov.size() && (size_t)size >= iov[index].iov_len) {
+      size -= iov[index].iov_len;
+      index++;
+    }
+    if (index < iov.size()) {
+      iov[index].iov_base = static_cast<char *>(iov[index].iov_base) + size;
+      iov[index].iov_len -= size;
+    }
+  }
+  return true;
+}
+
+#endif // SOCKET_IO_HPP
@@ -1,7 +1,10 @@
 #ifndef STRUCTURED_DATA_HPP
 #define STRUCTURED_DATA_HPP
 
+#include "BlobArena.hpp"
 #include "Common.hpp"
+#include "ProfiledMutex.hpp"
+#include "Protocol.hpp"
 #include <torch/torch.h>
 
 using NamedParameters = torch::OrderedDict<std::string, at::Tensor>;
@@ -22,12 +25,12 @@ using AgentOutput = std::tuple<torch::Tensor, LstmStates>;
 
 struct Event {
   bool notify = false;
-  std::mutex mtx;
-  std::condition_variable cv;
+  ProfiledMutex mtx{"event"};
+  std::condition_variable_any cv;
 
   void wait() {
     {
-      std::unique_lock<std::mutex> lk(mtx);
+      std::unique_lock<ProfiledMutex> lk(mtx);
       cv.wait(lk, [&] { return notify; });
       notify = false;
     }
@@ -40,19 +43,12 @@ struct Event {
   }
 
   void reset() {
-    std::lock_guard<std::mutex> lk(mtx);
+    std::lock_guard<ProfiledMutex> lk(mtx);
     // 共有データの更新
     notify = false;
   }
 };
 
-struct Request {
-  int envId;
-  uint8_t state[STATE_SIZE];
-  float reward;
-  bool done;
-} __attribute__((packed));
-
 struct AgentInput {
   AgentInput(torch::Tensor state_, int batchSize, int seqLength,
              torch::Device device) {
@@ -93,23 +89,21 @@ struct ReplayData {
   float hiddenStates[LSTM_STATE_SIZE];
   float cellStates[LSTM_STATE_SIZE];
   bool done[SEQ_LENGTH];
+  // エピソード終了までの有効なステップ数。以降はゼロ埋め
+  int length;
 };
 
-struct Transition : ReplayData {
-  Transition() {}
-
-  ReplayData &getReplayData() {
-    std::copy(hiddenStates[1], hiddenStates[1] + LSTM_STATE_SIZE,
-              ReplayData::hiddenStates);
-    std::copy(cellStates[1], cellStates[1] + LSTM_STATE_SIZE,
-              ReplayData::cellStates);
-
-    return ReplayData::getReplayData();
-  }
-
-  float hiddenStates[SEQ_LENGTH][LSTM_STATE_SIZE];
-  float cellStates[SEQ_LENGTH][LSTM_STATE_SIZE];
-  float q[SEQ_LENGTH][ACTION_SIZE];
+// ReplayDataを組み立てずに圧縮するための、各フィールドの参照
+// 画面はリングバッファ上にあるので、ステップごとのポインタで持つ
+struct ReplayDataView {
+  std::array<const uint8_t *, SEQ_LENGTH> state;
+  const uint8_t *action;
+  const float *reward;
+  const float *policy;
+  const float *hiddenStates;
+  const float *cellStates;
+  const bool *done;
+  int length;
 };
 
 struct RetraceData {
@@ -131,6 +125,7 @@ struct RetraceData {
                   .to(device);
     targetQ = torch::empty({batchSize, seqLength, actionSize}, torch::kFloat32)
                   .to(device);
+    length = torch::empty({batchSize}, torch::kInt64);
   }
 
   torch::Tensor action;
@@ -139,12 +134,25 @@ struct RetraceData {
   torch::Tensor policy;
   torch::Tensor onlineQ;
   torch::Tensor targetQ;
+  // 有効なステップ数（CPU）
+  torch::Tensor length;
+};
+
+// セグメントログ上のブロブの位置
+struct LogLocation {
+  int segment = -1;
+  int64_t offset = 0;
+  uint64_t generation = 0;
+
+  bool operator==(const LogLocation &) const = default;
 };
 
 struct StoredData {
   int size = 0;
   float reward = 0;
-  std::unique_ptr<char[]> ptr;
+  // メモリ上にない（ディスクのみにある）場合はnullptr
+  BlobPtr ptr;
+  LogLocation location;
 };
 
 struct SampleData {
@@ -153,6 +161,13 @@ struct SampleData {
   std::array<int, BATCH_SIZE> labelList;
 };
 
+// リプレイサーバーから受け取る、圧縮済みのままのサンプル
+struct SampleBlobs {
+  std::array<std::vector<char>, BATCH_SIZE> blobList;
+  std::array<int, BATCH_SIZE> indexList;
+  std::array<int, BATCH_SIZE> labelList;
+};
+
 struct TrainData {
   TrainData() {
     torch::Device device(torch::cuda::is_available() ? torch::kCUDA
@@ -176,6 +191,7 @@ struct TrainData {
     cellStates =
         torch::empty({BATCH_SIZE, LSTM_STATE_SIZE}, options).to(device);
     policy = torch::empty({BATCH_SIZE, SEQ_LENGTH}, torch::kFloat32).to(device);
+    length = torch::empty({BATCH_SIZE}, torch::kInt64);
   }
 
   torch::Tensor state;
@@ -185,6 +201,10 @@ struct TrainData {
   torch::Tensor hiddenStates;
   torch::Tensor cellStates;
   torch::Tensor policy;
+  // 有効なステップ数（CPU）。バッチは長い順に並べる
+  torch::Tensor length;
+  // 各行がSampleDataの何番目か
+  std::array<int, BATCH_SIZE> order;
 };
 
 #endif // STRUCTURED_DATA_HPP
@@ -3,31 +3,34 @@
 
 #include <vector>
 #include "StructuredData.hpp"
+#include <algorithm>
 #include <memory>
 #include <cmath>
 
+// 外から見えるインデックスはデータのインデックス
+// 配列はcapacityまで、書き込み位置に合わせて倍々に広げる
 class SumTree
 {
 public:
   SumTree(int capacity_)
       : capacity(capacity_),
+        leaves(std::min(capacity_, REPLAY_TREE_INITIAL_SIZE)),
         write(0),
-        tree(2 * capacity - 1, 0),
-        data(capacity)
+        tree(2 * leaves - 1, 0),
+        data(leaves)
   {
   }
 
-  int total()
+  float total()
   {
     return tree[0];
   }
 
   void add(float p, StoredData data_)
   {
-    auto idx = write + capacity - 1;
-
+    reserve(write);
     data[write] = std::move(data_);
-    update(idx, p);
+    update(write, p);
 
     write += 1;
     if (write >= capacity)
@@ -36,31 +39,71 @@ public:
     }
   }
 
-  void update(int idx, float p)
+  void update(int dataIdx, float p)
   {
+    auto idx = leafIndex(dataIdx);
     auto change = p - tree[idx];
 
     tree[idx] = p;
     propagate(idx, change);
   }
 
+  // dataIdxまで使えるように配列を広げる
+  void reserve(int dataIdx)
+  {
+    while (dataIdx >= leaves)
+    {
+      grow(std::min(leaves * 2, capacity));
+    }
+  }
+
+  int nextIndex() { return write; }
+
+  // 今確保している数
+  int size() { return leaves; }
+
+  float priority(int dataIdx) { return tree[leafIndex(dataIdx)]; }
+
+  StoredData &at(int dataIdx) { return data[dataIdx]; }
+
+  // 木とデータの配列が確保しているバイト数（ブロブ自体は含まない）
+  int64_t memoryBytes()
+  {
+    return tree.capacity() * sizeof(float) +
+           data.capacity() * sizeof(StoredData);
+  }
+
   std::tuple<int, StoredData&> get(float s)
   {
     auto idx = retrieve(0, s);
-    auto dataIdx = idx - capacity + 1;
-    return {idx, data[dataIdx]};
+    auto dataIdx = idx - leaves + 1;
+    return {dataIdx, data[dataIdx]};
   }
 
 private:
-  void propagate(int idx, float change)
-  {
-    auto parent = std::floor((idx - 1) / 2);
+  int leafIndex(int dataIdx) { return dataIdx + leaves - 1; }
 
-    tree[parent] += change;
+  // 葉の位置が変わるので、葉を移して合計を下から計算し直す
+  void grow(int newLeaves)
+  {
+    std::vector<float> newTree(2 * newLeaves - 1, 0);
+    std::copy(tree.begin() + leaves - 1, tree.end(),
+              newTree.begin() + newLeaves - 1);
+    for (int i = newLeaves - 2; i >= 0; i--)
+    {
+      newTree[i] = newTree[2 * i + 1] + newTree[2 * i + 2];
+    }
+    tree.swap(newTree);
+    data.resize(newLeaves);
+    leaves = newLeaves;
+  }
 
-    if (parent != 0)
+  void propagate(int idx, float change)
+  {
+    while (idx != 0)
     {
-      propagate(parent, change);
+      idx = (idx - 1) / 2;
+      tree[idx] += change;
     }
   }
 
@@ -85,6 +128,7 @@ private:
   }
 
   int capacity;
+  int leaves;
   int write;
   std::vector<float> tree;
   std::vector<StoredData> data;
@@ -0,0 +1,75 @@
+#ifndef TASK_SCHEDULER_HPP
+#define TASK_SCHEDULER_HPP
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 展開、バッチの組み立て、優先度の計算、リプレイへの追加、
+// チェックポイントの書き出しなどを共通のワーカーで実行する
+// ワーカーごとに優先度別のキューを持ち、自分のキューが空なら他から盗む
+// 優先度が高いものから取るので、遅れている段に空いたコアが回る
+enum class TaskPriority { High, Normal, Low };
+const auto NUM_TASK_PRIORITIES = 3;
+
+using Task = std::function<void()>;
+
+class TaskScheduler {
+public:
+  explicit TaskScheduler(int numThreads);
+  ~TaskScheduler();
+
+  // ワーカーから呼ぶと自分のキューに、それ以外からは順番にワーカーのキューに積む
+  void submit(TaskPriority priority, Task task);
+
+  // lowest以上の優先度のタスクを一つ実行する。無ければfalse
+  // 完了を待っているスレッドが手伝うのに使う
+  bool runOne(TaskPriority lowest);
+
+private:
+  struct alignas(64) Worker {
+    std::mutex mtx;
+    std::array<std::deque<Task>, NUM_TASK_PRIORITIES> queues;
+  };
+
+  // 自分のキューは新しいものから、他のキューは古いものから取る
+  bool pop(int self, TaskPriority lowest, Task &task);
+  void workerLoop(int index);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<int> pending{0};
+  std::atomic<int> nextWorker{0};
+  std::atomic<bool> stopping{false};
+  std::mutex sleepMtx;
+  std::condition_variable sleepCv;
+};
+
+// TASK_SCHEDULER_THREADS個のワーカーを持つ共通のスケジューラー
+TaskScheduler &scheduler();
+
+// まとめて投げたタスクの完了を待つ
+// 待っている間は、高優先度のタスクを手伝う
+class TaskGroup {
+public:
+  void run(TaskPriority priority, Task task);
+  void wait();
+
+private:
+  int count = 0;
+  std::mutex mtx;
+  std::condition_variable cv;
+};
+
+// fn(0) ... fn(n - 1)を並列に実行し、終わるまで待つ
+// fn(0)は呼び出したスレッドで実行する
+void parallelFor(int n, TaskPriority priority,
+                 const std::function<void(int)> &fn);
+
+#endif // TASK_SCHEDULER_HPP
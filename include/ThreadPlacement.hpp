@@ -0,0 +1,28 @@
+#ifndef THREAD_PLACEMENT_HPP
+#define THREAD_PLACEMENT_HPP
+
+#include <cstddef>
+
+// スレッドの役割
+// Inference: アクターとの通信、推論、圧縮（接続ごとに一つ）
+// Replay: リプレイのアリーナを置くノード
+// Train: 学習（NUM_TRAIN_THREADS個までは専用のコア、それ以上は推論のコア）
+// Background: メトリクスの書き出し
+// Worker: TaskSchedulerのワーカー（推論と同じコアを使う）
+enum class ThreadRole { Inference, Replay, Train, Background, Worker };
+
+// コアを役割ごとに分け、interopスレッド数を設定して、配置を表示する
+// THREAD_PLACEMENT_ENABLEDがfalseなら何もしない
+void initThreadPlacement();
+
+// 呼び出したスレッドを役割のコアに固定し、intra-opスレッド数を役割の分にする
+// indexはTrainのスレッド番号
+void placeCurrentThread(ThreadRole role, int index = 0);
+
+// 役割のコアがあるNUMAノード
+int roleNode(ThreadRole role, int index = 0);
+
+// まだ触れていないメモリを、指定したNUMAノードから確保するようにする
+void bindMemoryToNode(void *addr, size_t size, int node);
+
+#endif // THREAD_PLACEMENT_HPP
@@ -0,0 +1,52 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// 各段の処理がどう重なっているかを見るためのタイムライン
+// 記録中だけ、スレッドごとのバッファにスパンを追加し、
+// 終わったらChrome Trace形式のJSON（Perfettoで開ける）に書き出す
+
+extern std::atomic<bool> gTracing;
+
+inline int64_t traceNowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// 呼び出したスレッドのバッファに追加する。ロックは取らない
+// nameは文字列リテラルなど、書き出しまで有効なもの
+void recordSpan(const char *name, int64_t start, int64_t end);
+
+// タイムラインに表示する、呼び出したスレッドの名前
+void setTraceThreadName(const std::string &name);
+
+// SIGUSR1を受けるか、requestTrace()を呼ぶと、TRACE_WINDOW_SEC秒だけ記録して
+// dir/trace-<時刻>.jsonに書き出すスレッドを開始する
+void startTracer(const std::string &dir);
+void requestTrace();
+
+// スコープの開始から終了までをスパンとして記録する
+// 記録していないときは、フラグを読むだけ
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name_)
+      : name(name_),
+        start(gTracing.load(std::memory_order_relaxed) ? traceNowNanos() : 0) {
+  }
+  ~TraceSpan() {
+    if (start != 0 && gTracing.load(std::memory_order_acquire)) {
+      recordSpan(name, start, traceNowNanos());
+    }
+  }
+
+private:
+  const char *name;
+  int64_t start;
+};
+
+#endif // TRACER_HPP
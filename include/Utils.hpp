@@ -3,16 +3,78 @@
 
 #include "Models.hpp"
 #include "StructuredData.hpp"
+#include <ATen/autocast_mode.h>
+#include <future>
 #include <torch/torch.h>
 
+// スコープ内のCPU演算をbfloat16へautocastする
+// autocastの状態はスレッドごとなので、訓練スレッドごとに使う
+class Bf16AutocastGuard {
+public:
+  Bf16AutocastGuard(bool enabled_) : enabled(enabled_) {
+    if (!enabled) {
+      return;
+    }
+    prevEnabled = at::autocast::is_cpu_enabled();
+    prevDtype = at::autocast::get_autocast_cpu_dtype();
+    at::autocast::set_cpu_enabled(true);
+    at::autocast::set_autocast_cpu_dtype(at::kBFloat16);
+    at::autocast::increment_nesting();
+  }
+
+  ~Bf16AutocastGuard() {
+    if (!enabled) {
+      return;
+    }
+    // 重みのbfloat16キャッシュは次のステップでは古いので捨てる
+    if (at::autocast::decrement_nesting() == 0) {
+      at::autocast::clear_cache();
+    }
+    at::autocast::set_cpu_enabled(prevEnabled);
+    at::autocast::set_autocast_cpu_dtype(prevDtype);
+  }
+
+  Bf16AutocastGuard(const Bf16AutocastGuard &) = delete;
+  Bf16AutocastGuard &operator=(const Bf16AutocastGuard &) = delete;
+
+private:
+  bool enabled;
+  bool prevEnabled = false;
+  at::ScalarType prevDtype = at::kBFloat16;
+};
+
+// スコープを抜けるときに、まだ受け取っていないfutureの完了を待つ
+// フレームを参照で持つタスクがあるときに、例外で先に抜けないようにする
+class FutureJoinGuard {
+public:
+  FutureJoinGuard(std::future<void> &future_) : future(future_) {}
+
+  ~FutureJoinGuard() {
+    if (future.valid()) {
+      future.wait();
+    }
+  }
+
+  FutureJoinGuard(const FutureJoinGuard &) = delete;
+  FutureJoinGuard &operator=(const FutureJoinGuard &) = delete;
+
+private:
+  std::future<void> &future;
+};
+
 std::tuple<float, torch::Tensor>
 retraceLoss(const torch::Tensor action, const torch::Tensor reward,
             const torch::Tensor done, const torch::Tensor policy,
             const torch::Tensor onlineQ, const torch::Tensor targetQ,
-            const torch::Device device, bool backward = false);
+            const torch::Device device, bool backward = false,
+            const torch::Tensor length = torch::Tensor());
 
-StoredData compress(ReplayData &replayData);
+StoredData compress(ReplayData &replayData,
+                    BlobArena::Writer *writer = nullptr);
+StoredData compress(const ReplayDataView &view,
+                    BlobArena::Writer *writer = nullptr);
 void decompress(StoredData &compressed, ReplayData &replayData);
+bool decompress(const char *src, int size, ReplayData &replayData);
 void toBatchedTrainData(TrainData &train,
                         std::array<ReplayData, BATCH_SIZE> &dataList);
 
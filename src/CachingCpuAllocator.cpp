@@ -0,0 +1,324 @@
+#include "CachingCpuAllocator.hpp"
+#include "Common.hpp"
+#include "Metrics.hpp"
+#include <array>
+#include <c10/core/Allocator.h>
+#include <c10/core/CPUAllocator.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <torch/version.h>
+#include <vector>
+
+namespace {
+
+// ブロックの先頭に置き、データはその後ろから始める
+// libtorchはデータが64バイト境界にあることを前提にしている
+struct BlockHeader {
+  int64_t bytes;
+  // 小さいもののサイズクラス。大きいものは-1
+  int sizeClass;
+};
+constexpr int64_t HEADER_SIZE = 64;
+
+// 小さいもののサイズクラスは MIN_BLOCK << k（ヘッダーを含む）
+constexpr int64_t MIN_BLOCK = 128;
+constexpr int NUM_CLASSES =
+    __builtin_ctzll(CPU_ALLOC_LARGE_BYTES / MIN_BLOCK) + 1;
+
+struct Stats {
+  Counter &smallHits;
+  Counter &smallMisses;
+  Counter &largeHits;
+  Counter &largeMisses;
+  Counter &allocatedBytes;
+  Counter &freedBytes;
+  Gauge &inUseBytes;
+  Gauge &mappedBytes;
+  Gauge &sharedCachedBytes;
+  Gauge &largeCachedBytes;
+};
+
+Stats &stats() {
+  static Stats instance{metrics().counter("cpu_alloc/small_hits"),
+                        metrics().counter("cpu_alloc/small_misses"),
+                        metrics().counter("cpu_alloc/large_hits"),
+                        metrics().counter("cpu_alloc/large_misses"),
+                        metrics().counter("cpu_alloc/allocated_bytes"),
+                        metrics().counter("cpu_alloc/freed_bytes"),
+                        metrics().gauge("cpu_alloc/in_use_bytes"),
+                        metrics().gauge("cpu_alloc/mapped_bytes"),
+                        metrics().gauge("cpu_alloc/shared_cached_bytes"),
+                        metrics().gauge("cpu_alloc/large_cached_bytes")};
+  return instance;
+}
+
+// 全スレッド共通の空きリスト
+struct SharedCache {
+  std::mutex mtx;
+  std::array<std::vector<void *>, NUM_CLASSES> lists;
+  int64_t bytes = 0;
+};
+
+// 大きいもの。ブロックの大きさ順に置く
+struct LargeCache {
+  std::mutex mtx;
+  std::multimap<int64_t, void *> blocks;
+  int64_t cachedBytes = 0;
+  int64_t mappedBytes = 0;
+};
+
+// 終了時に静的変数が破棄された後も、残ったテンソルの解放で使われるので破棄しない
+SharedCache &sharedCache() {
+  static auto *instance = new SharedCache;
+  return *instance;
+}
+
+LargeCache &largeCache() {
+  static auto *instance = new LargeCache;
+  return *instance;
+}
+
+void releaseSmall(void *block, int sizeClass);
+
+// スレッドが終わるときに、残っているものを共通のリストに回す
+// 0: まだ作っていない、1: 使える、2: 破棄済み
+thread_local int tCacheState = 0;
+
+struct ThreadCache {
+  ThreadCache() { tCacheState = 1; }
+  ~ThreadCache() {
+    tCacheState = 2;
+    for (int k = 0; k < NUM_CLASSES; k++) {
+      for (auto *block : lists[k]) {
+        releaseSmall(block, k);
+      }
+    }
+  }
+
+  std::array<std::vector<void *>, NUM_CLASSES> lists;
+  int64_t bytes = 0;
+};
+
+thread_local ThreadCache tCache;
+
+int64_t classBytes(int sizeClass) { return MIN_BLOCK << sizeClass; }
+
+int sizeClassOf(int64_t bytes) {
+  if (bytes <= MIN_BLOCK) {
+    return 0;
+  }
+  return 64 - __builtin_clzll(bytes - 1) - __builtin_ctzll(MIN_BLOCK);
+}
+
+// 取得や解放のたびには更新せず、mallocやmmapを通るときだけ更新する
+void updateGauges() {
+  auto &s = stats();
+  s.inUseBytes.set(s.allocatedBytes.value() - s.freedBytes.value());
+  {
+    auto &shared = sharedCache();
+    std::lock_guard<std::mutex> lock(shared.mtx);
+    s.sharedCachedBytes.set(shared.bytes);
+  }
+  auto &large = largeCache();
+  std::lock_guard<std::mutex> lock(large.mtx);
+  s.mappedBytes.set(large.mappedBytes);
+  s.largeCachedBytes.set(large.cachedBytes);
+}
+
+void *allocateSmall(int sizeClass) {
+  auto &s = stats();
+  auto bytes = classBytes(sizeClass);
+
+  if (tCacheState != 2) {
+    auto &list = tCache.lists[sizeClass];
+    if (!list.empty()) {
+      auto *block = list.back();
+      list.pop_back();
+      tCache.bytes -= bytes;
+      s.smallHits.add();
+      return block;
+    }
+  }
+
+  {
+    auto &shared = sharedCache();
+    std::lock_guard<std::mutex> lock(shared.mtx);
+    auto &list = shared.lists[sizeClass];
+    if (!list.empty()) {
+      auto *block = list.back();
+      list.pop_back();
+      shared.bytes -= bytes;
+      s.smallHits.add();
+      return block;
+    }
+  }
+
+  void *block = nullptr;
+  if (posix_memalign(&block, HEADER_SIZE, bytes) != 0) {
+    printf("failed to allocate %ld bytes for tensor\n", bytes);
+    exit(EXIT_FAILURE);
+  }
+  s.smallMisses.add();
+  updateGauges();
+  return block;
+}
+
+void releaseSmall(void *block, int sizeClass) {
+  auto bytes = classBytes(sizeClass);
+
+  if (tCacheState == 1 &&
+      tCache.bytes + bytes <= CPU_ALLOC_THREAD_CACHE_BYTES) {
+    tCache.lists[sizeClass].push_back(block);
+    tCache.bytes += bytes;
+    return;
+  }
+
+  {
+    auto &shared = sharedCache();
+    std::lock_guard<std::mutex> lock(shared.mtx);
+    if (shared.bytes + bytes <= CPU_ALLOC_SHARED_CACHE_BYTES) {
+      shared.lists[sizeClass].push_back(block);
+      shared.bytes += bytes;
+      return;
+    }
+  }
+  free(block);
+}
+
+// Huge Pagesで裏打ちされるように、2MB境界から始まる領域を確保する
+void *mapLarge(int64_t bytes) {
+  auto mappedSize = bytes + CPU_ALLOC_LARGE_BYTES;
+  auto *ptr = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    printf("failed to mmap %ld bytes for tensor(errno:%d, error_str:%s)\n",
+           bytes, errno, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  auto addr = reinterpret_cast<uintptr_t>(ptr);
+  auto aligned = (addr + CPU_ALLOC_LARGE_BYTES - 1) &
+                 ~(uintptr_t)(CPU_ALLOC_LARGE_BYTES - 1);
+  auto head = aligned - addr;
+  auto tail = mappedSize - head - bytes;
+  if (head > 0) {
+    munmap(ptr, head);
+  }
+  if (tail > 0) {
+    munmap(reinterpret_cast<char *>(aligned + bytes), tail);
+  }
+  auto *block = reinterpret_cast<void *>(aligned);
+  madvise(block, bytes, MADV_HUGEPAGE);
+  return block;
+}
+
+void *allocateLarge(int64_t &bytes) {
+  auto &s = stats();
+  auto &large = largeCache();
+  {
+    std::lock_guard<std::mutex> lock(large.mtx);
+    auto iter = large.blocks.lower_bound(bytes);
+    if (iter != large.blocks.end() &&
+        iter->first <= bytes * CPU_ALLOC_LARGE_MAX_WASTE) {
+      bytes = iter->first;
+      auto *block = iter->second;
+      large.blocks.erase(iter);
+      large.cachedBytes -= bytes;
+      s.largeHits.add();
+      return block;
+    }
+    large.mappedBytes += bytes;
+  }
+
+  auto *block = mapLarge(bytes);
+  s.largeMisses.add();
+  updateGauges();
+  return block;
+}
+
+void releaseLarge(void *block, int64_t bytes) {
+  auto &large = largeCache();
+  {
+    std::lock_guard<std::mutex> lock(large.mtx);
+    if (large.cachedBytes + bytes <= CPU_ALLOC_LARGE_CACHE_BYTES) {
+      large.blocks.emplace(bytes, block);
+      large.cachedBytes += bytes;
+      return;
+    }
+    large.mappedBytes -= bytes;
+  }
+  munmap(block, bytes);
+}
+
+void deleteBlock(void *ctx) {
+  if (ctx == nullptr) {
+    return;
+  }
+  auto *header = static_cast<BlockHeader *>(ctx);
+  stats().freedBytes.add(header->bytes);
+  if (header->sizeClass >= 0) {
+    releaseSmall(ctx, header->sizeClass);
+  } else {
+    releaseLarge(ctx, header->bytes);
+  }
+}
+
+c10::DataPtr allocateBlock(size_t n) {
+  if (n == 0) {
+    return {nullptr, nullptr, &deleteBlock, c10::Device(c10::DeviceType::CPU)};
+  }
+
+  int64_t bytes = n + HEADER_SIZE;
+  void *block;
+  int sizeClass;
+  if (bytes <= CPU_ALLOC_LARGE_BYTES) {
+    sizeClass = sizeClassOf(bytes);
+    bytes = classBytes(sizeClass);
+    block = allocateSmall(sizeClass);
+  } else {
+    sizeClass = -1;
+    bytes = (bytes + CPU_ALLOC_LARGE_BYTES - 1) & ~(CPU_ALLOC_LARGE_BYTES - 1);
+    block = allocateLarge(bytes);
+  }
+
+  auto *header = static_cast<BlockHeader *>(block);
+  header->bytes = bytes;
+  header->sizeClass = sizeClass;
+  stats().allocatedBytes.add(bytes);
+
+  auto *data = static_cast<char *>(block) + HEADER_SIZE;
+  return {data, block, &deleteBlock, c10::Device(c10::DeviceType::CPU)};
+}
+
+// libtorch 2.3からallocateがconstでなくなり、copy_dataが必要になった
+class CachingCpuAllocator final : public c10::Allocator {
+public:
+#if TORCH_VERSION_MAJOR > 2 ||                                                 \
+    (TORCH_VERSION_MAJOR == 2 && TORCH_VERSION_MINOR >= 3)
+  c10::DataPtr allocate(size_t n) override { return allocateBlock(n); }
+
+  void copy_data(void *dest, const void *src, size_t count) const override {
+    default_copy_data(dest, src, count);
+  }
+#else
+  c10::DataPtr allocate(size_t n) const override { return allocateBlock(n); }
+#endif
+};
+
+} // namespace
+
+void installCachingCpuAllocator() {
+  auto *env = getenv("CPU_CACHING_ALLOCATOR");
+  if (!CPU_CACHING_ALLOCATOR_ENABLED && !(env && atoi(env) != 0)) {
+    return;
+  }
+  // 終了時に残ったテンソルからも使われるので破棄しない
+  static auto *allocator = new CachingCpuAllocator;
+  c10::SetCPUAllocator(allocator);
+  printf("caching cpu allocator: enabled\n");
+}
@@ -0,0 +1,128 @@
+#include "Distributed.hpp"
+#include "Common.hpp"
+#include "Metrics.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+// CMakeのLEARNER_WITH_GLOOで有効になる
+#ifdef LEARNER_WITH_GLOO
+#include <torch/csrc/distributed/c10d/ProcessGroupGloo.hpp>
+#include <torch/csrc/distributed/c10d/TCPStore.hpp>
+#endif
+
+namespace {
+
+int gRank = 0;
+int gWorldSize = 1;
+#ifdef LEARNER_WITH_GLOO
+c10::intrusive_ptr<::c10d::ProcessGroupGloo> gProcessGroup;
+#endif
+
+int envInt(const char *name, int defaultValue) {
+  auto *value = getenv(name);
+  return value ? atoi(value) : defaultValue;
+}
+
+#ifdef LEARNER_WITH_GLOO
+// 全テンソルを一つの連続領域にまとめ、集合通信を一回で済ませる
+// 呼び出しは訓練スレッドのうち一つからだけなので、バッファは使い回す
+template <typename F>
+void flatRun(const std::vector<torch::Tensor> &tensors, F collective) {
+  static torch::Tensor flat;
+
+  int64_t numel = 0;
+  for (auto &t : tensors) {
+    numel += t.numel();
+  }
+  if (!flat.defined() || flat.numel() != numel) {
+    flat = torch::empty({numel}, torch::kFloat);
+  }
+
+  int64_t offset = 0;
+  for (auto &t : tensors) {
+    flat.narrow(0, offset, t.numel()).copy_(t.reshape(-1));
+    offset += t.numel();
+  }
+
+  std::vector<at::Tensor> buffers = {flat};
+  collective(buffers)->wait();
+
+  offset = 0;
+  for (auto &t : tensors) {
+    t.copy_(flat.narrow(0, offset, t.numel()).view_as(t));
+    offset += t.numel();
+  }
+}
+#endif
+
+} // namespace
+
+void initDistributed() {
+  gWorldSize = envInt("WORLD_SIZE", 1);
+  gRank = envInt("RANK", 0);
+  if (gWorldSize <= 1) {
+    gWorldSize = 1;
+    gRank = 0;
+    return;
+  }
+
+#ifndef LEARNER_WITH_GLOO
+  printf("WORLD_SIZE=%d, but this build has no Gloo backend "
+         "(configure with -DLEARNER_WITH_GLOO=ON)\n",
+         gWorldSize);
+  exit(EXIT_FAILURE);
+#else
+  auto *addr = getenv("MASTER_ADDR");
+  std::string masterAddr = addr ? addr : "127.0.0.1";
+  auto masterPort = envInt("MASTER_PORT", DISTRIBUTED_DEFAULT_PORT);
+
+  ::c10d::TCPStoreOptions storeOptions;
+  storeOptions.port = masterPort;
+  storeOptions.isServer = gRank == 0;
+  storeOptions.numWorkers = gWorldSize;
+  storeOptions.waitWorkers = true;
+  storeOptions.timeout = std::chrono::minutes(DISTRIBUTED_TIMEOUT_MIN);
+  auto store = c10::make_intrusive<::c10d::TCPStore>(masterAddr, storeOptions);
+
+  auto options = ::c10d::ProcessGroupGloo::Options::create();
+  options->devices.push_back(
+      ::c10d::ProcessGroupGloo::createDefaultDevice());
+  // リプレイが溜まるまでの時間はプロセスごとに違うので、長めに待つ
+  options->timeout = std::chrono::minutes(DISTRIBUTED_TIMEOUT_MIN);
+
+  gProcessGroup = c10::make_intrusive<::c10d::ProcessGroupGloo>(
+      store, gRank, gWorldSize, options);
+
+  std::cout << "joined process group, rank " << gRank << " / " << gWorldSize
+            << " (" << masterAddr << ":" << masterPort << ")" << std::endl;
+#endif
+}
+
+int distributedRank() { return gRank; }
+
+int distributedWorldSize() { return gWorldSize; }
+
+void allReduceSum(const std::vector<torch::Tensor> &tensors) {
+  static auto &allReduceTime = metrics().histogram("train/allreduce_us");
+  if (gWorldSize <= 1) {
+    return;
+  }
+#ifdef LEARNER_WITH_GLOO
+  ScopedTimer timer(allReduceTime);
+  flatRun(tensors, [&](std::vector<at::Tensor> &buffers) {
+    return gProcessGroup->allreduce(buffers);
+  });
+#endif
+}
+
+void broadcastFromRank0(const std::vector<torch::Tensor> &tensors) {
+  if (gWorldSize <= 1) {
+    return;
+  }
+#ifdef LEARNER_WITH_GLOO
+  torch::NoGradGuard no_grad;
+  flatRun(tensors, [&](std::vector<at::Tensor> &buffers) {
+    return gProcessGroup->broadcast(buffers);
+  });
+#endif
+}
@@ -0,0 +1,126 @@
+#include "EventWriter.hpp"
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <unistd.h>
+
+namespace {
+
+// TFRecordのチェックサムはCRC32C（Castagnoli）
+std::array<uint32_t, 256> makeCrcTable() {
+  std::array<uint32_t, 256> table;
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+uint32_t crc32c(const char *data, size_t size) {
+  static const auto table = makeCrcTable();
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+uint32_t maskedCrc(const char *data, size_t size) {
+  auto crc = crc32c(data, size);
+  return ((crc >> 15) | (crc << 17)) + 0xa282ead8;
+}
+
+// protobufのエンコード
+void putVarint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((char)v);
+}
+
+void putTag(std::string &out, int field, int wireType) {
+  putVarint(out, (field << 3) | wireType);
+}
+
+template <typename T> void putFixed(std::string &out, T v) {
+  char buf[sizeof(T)];
+  memcpy(buf, &v, sizeof(T));
+  out.append(buf, sizeof(T));
+}
+
+void putBytes(std::string &out, int field, const std::string &bytes) {
+  putTag(out, field, 2);
+  putVarint(out, bytes.size());
+  out.append(bytes);
+}
+
+// Event { double wall_time = 1; int64 step = 2; string file_version = 3;
+//         Summary summary = 5; }
+std::string eventHeader(int64_t step) {
+  auto wallTime =
+      std::chrono::duration<double>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  std::string event;
+  putTag(event, 1, 1);
+  putFixed<double>(event, wallTime);
+  putTag(event, 2, 0);
+  putVarint(event, step);
+  return event;
+}
+
+} // namespace
+
+EventWriter::EventWriter(const std::string &dir) {
+  std::filesystem::create_directories(dir);
+
+  char host[256] = {0};
+  gethostname(host, sizeof(host) - 1);
+  auto now = std::chrono::duration_cast<std::chrono::seconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  auto path = std::filesystem::path(dir) /
+              ("events.out.tfevents." + std::to_string(now) + "." + host);
+  file.open(path, std::ios::binary | std::ios::app);
+
+  auto event = eventHeader(0);
+  putBytes(event, 3, "brain.Event:2");
+  writeRecord(event);
+}
+
+void EventWriter::writeScalars(
+    const std::vector<std::pair<std::string, float>> &values, int64_t step) {
+  // Summary { repeated Value value = 1; }
+  // Value { string tag = 1; float simple_value = 2; }
+  std::string summary;
+  for (auto &[tag, value] : values) {
+    std::string summaryValue;
+    putBytes(summaryValue, 1, tag);
+    putTag(summaryValue, 2, 5);
+    putFixed<float>(summaryValue, value);
+    putBytes(summary, 1, summaryValue);
+  }
+
+  auto event = eventHeader(step);
+  putBytes(event, 5, summary);
+  writeRecord(event);
+  file.flush();
+}
+
+// uint64 length, uint32 masked crc of length, data, uint32 masked crc of data
+void EventWriter::writeRecord(const std::string &data) {
+  std::string header;
+  putFixed<uint64_t>(header, data.size());
+  putFixed<uint32_t>(header, maskedCrc(header.data(), sizeof(uint64_t)));
+  file.write(header.data(), header.size());
+  file.write(data.data(), data.size());
+
+  std::string footer;
+  putFixed<uint32_t>(footer, maskedCrc(data.data(), data.size()));
+  file.write(footer.data(), footer.size());
+}
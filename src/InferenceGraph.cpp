@@ -0,0 +1,112 @@
+#include "InferenceGraph.hpp"
+#include "Metrics.hpp"
+#include "TaskScheduler.hpp"
+#include <regex>
+
+namespace {
+
+// パラメーター名の"."は"_"にして属性にする（conv1.weight -> conv1_weight）
+// LSTMの出力はR2D2Agent::forwardと同じくセル状態をヘッドに渡す
+std::string stepSource(int64_t nActions) {
+  return R"JIT(
+def forward(self, x: Tensor, prev_action: Tensor, prev_reward: Tensor,
+            h: Tensor, c: Tensor) -> Tuple[Tensor, Tensor, Tensor]:
+    batch = h.size(0)
+    f = x.flatten(0, 1)
+    f = torch.relu(torch.conv2d(f, self.conv1_weight, self.conv1_bias, [4, 4]))
+    f = torch.relu(torch.conv2d(f, self.conv2_weight, self.conv2_bias, [2, 2]))
+    f = torch.relu(torch.conv2d(f, self.conv3_weight, self.conv3_bias, [1, 1]))
+    f = f.reshape(batch, -1)
+    a = torch.one_hot(prev_action.reshape(batch), )JIT" +
+         std::to_string(nActions) + R"JIT().float()
+    inp = torch.cat([f, prev_reward.reshape(batch, 1), a], 1)
+    hy, cy = torch.lstm_cell(inp, [h, c], self.lstm_weight_ih,
+                             self.lstm_weight_hh, self.lstm_bias_ih,
+                             self.lstm_bias_hh)
+    adv = torch.relu(torch.linear(cy, self.adv1_weight, self.adv1_bias))
+    adv = torch.linear(adv, self.adv2_weight, self.adv2_bias)
+    adv = adv - adv.mean(-1, keepdim=True)
+    v = torch.relu(torch.linear(cy, self.state1_weight, self.state1_bias))
+    v = torch.linear(v, self.state2_weight, self.state2_bias)
+    q = (adv + v).reshape(batch, 1, -1)
+    return q, hy, cy
+)JIT";
+}
+
+} // namespace
+
+void InferenceGraph::rebuild(R2D2Agent &model) {
+  rebuild(model.named_parameters(true /*recurse*/), model.nActions);
+}
+
+void InferenceGraph::rebuildLater(std::shared_ptr<const NamedParameters> params,
+                                  int64_t nActions) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    pending = std::move(params);
+    if (rebuilding) {
+      return;
+    }
+    rebuilding = true;
+  }
+
+  scheduler().submit(TaskPriority::Low, [this, nActions] {
+    while (1) {
+      std::shared_ptr<const NamedParameters> next;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        next = std::move(pending);
+        if (!next) {
+          rebuilding = false;
+          return;
+        }
+      }
+      rebuild(*next, nActions);
+    }
+  });
+}
+
+void InferenceGraph::rebuild(const NamedParameters &params, int64_t nActions) {
+  static auto &rebuildTime = metrics().histogram("inference/graph_rebuild_us");
+  ScopedTimer timer(rebuildTime);
+  torch::NoGradGuard no_grad;
+
+  torch::jit::Module step("R2D2Step");
+  for (auto &val : params) {
+    auto name = std::regex_replace(val.key(), std::regex("\\."), "_");
+    step.register_parameter(name, val.value().detach().clone(), false);
+  }
+  step.define(stepSource(nActions));
+  step.eval();
+
+  // optimize_for_inferenceは左辺値を受け取るので、freezeしたものを変数に置く
+  auto frozenStep = torch::jit::freeze(step);
+  auto frozen = std::make_shared<torch::jit::Module>(
+      torch::jit::optimize_for_inference(frozenStep));
+
+  // プロファイリング実行をここで済ませ、推論スレッドには最適化済みのグラフを渡す
+  auto x = torch::zeros({1, 1, 1, 84, 84});
+  auto prevAction = torch::zeros({1, 1}, torch::kLong);
+  auto prevReward = torch::zeros({1, 1, 1});
+  auto lstmStates = LstmStates(torch::zeros({1, LSTM_STATE_SIZE}),
+                               torch::zeros({1, LSTM_STATE_SIZE}));
+  for (int i = 0; i < 3; i++) {
+    forward(*frozen, x, prevAction, prevReward, lstmStates);
+  }
+
+  std::lock_guard<std::mutex> lock(mtx);
+  module = std::move(frozen);
+}
+
+AgentOutput InferenceGraph::forward(torch::jit::Module &module,
+                                    const torch::Tensor x,
+                                    const torch::Tensor prevAction,
+                                    const torch::Tensor prevReward,
+                                    const LstmStates lstmStates) {
+  auto [hiddenState, cellState] = lstmStates;
+  auto out = module.forward({x, prevAction, prevReward, hiddenState, cellState})
+                 .toTuple();
+  return {out->elements()[0].toTensor(),
+          std::make_tuple(out->elements()[1].toTensor(),
+                          out->elements()[2].toTensor())};
+}
@@ -1,22 +1,62 @@
 #include "Learner.hpp"
 #include "CalculateGrad.hpp"
+#include "FrameCodec.hpp"
+#include "Metrics.hpp"
+#include "TaskScheduler.hpp"
+#include "ThreadPlacement.hpp"
+#include "Tracer.hpp"
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <filesystem>
+#include <future>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pwd.h>
 #include <shared_mutex>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
-// #include <tensorflow/core/util/events_writer.h>
 
 using namespace torch::indexing;
-std::vector<Agent> gAgents(NUM_TRAIN_THREADS, Agent(ACTION_SIZE));
-std::array<SampleData, NUM_TRAIN_THREADS> gSamples;
-std::array<TrainData, NUM_TRAIN_THREADS> gTrainDatas;
-NamedParameters gTrainParams;
-NamedParameters gTrainBuffers;
-int gTrainCount = 0;
+// 学習スレッド0が公開した推論用の重みの写し
+// 公開するたびに新しく作って差し替えるので、読む側は取り出したものをそのまま使える
+struct PublishedWeights {
+  NamedParameters params;
+  NamedParameters buffers;
+};
+std::mutex gPublishMtx;
+std::shared_ptr<PublishedWeights> gPublished;
+// 公開した回数
+std::atomic<int> gTrainCount{0};
+// 訓練モデルのパラメーターを公開した時刻（マイクロ秒）
+std::atomic<int64_t> gPublishTime = 0;
+
+// 学習中のテンソルは次のステップで書き換わるので、写しを公開する
+void publishWeights(R2D2Agent &net) {
+  torch::NoGradGuard no_grad;
+  auto weights = std::make_shared<PublishedWeights>();
+  for (auto &val : net.named_parameters(true)) {
+    weights->params.insert(val.key(), val.value().detach().clone());
+  }
+  for (auto &val : net.named_buffers(true)) {
+    weights->buffers.insert(val.key(), val.value().detach().clone());
+  }
+  {
+    std::lock_guard<std::mutex> lock(gPublishMtx);
+    gPublished = std::move(weights);
+  }
+  gPublishTime = nowMicros();
+  gTrainCount++;
+}
+
+std::shared_ptr<PublishedWeights> publishedWeights() {
+  std::lock_guard<std::mutex> lock(gPublishMtx);
+  return gPublished;
+}
 
 int Learner::listenActor() {
 
@@ -26,12 +66,9 @@ int Learner::listenActor() {
   int fd_accept = -1; // 接続受け付け用のFD
   int fd_other = -1;  // sendとかrecv用のFD
 
-  struct passwd *pw = getpwuid(getuid());
-  auto home = std::string(pw->pw_dir);
-  char INFER_SOCKET[50];
-  sprintf(INFER_SOCKET, "%s/infer.sock", home.c_str());
+  auto inferSocket = inferSocketPath();
 
-  remove(INFER_SOCKET);
+  remove(inferSocket.c_str());
 
   // ソケットアドレス構造体←今回はここがUNIXドメイン用のやつ
   struct sockaddr_un sun, sun_client;
@@ -50,7 +87,7 @@ int Learner::listenActor() {
 
   // ソケットアドレス構造体を設定
   sun.sun_family = AF_LOCAL;          // UNIXドメイン
-  strcpy(sun.sun_path, INFER_SOCKET); // UNIXドメインソケットのパスを指定
+  strcpy(sun.sun_path, inferSocket.c_str()); // UNIXドメインソケットのパスを指定
 
   // 上記設定をソケットに紐づける
   ret_code = bind(fd_accept, (const struct sockaddr *)&sun, sizeof(sun));
@@ -71,10 +108,6 @@ int Learner::listenActor() {
 
   std::vector<std::thread> threadList;
 
-  R2D2Agent inferModel(1, ACTION_SIZE);
-  // 推論モデルの計算グラフは切っておく
-  inferModel.detach_();
-
   // 無限ループのサーバー処理
   while (1) {
     // printf("accept wating...\n");
@@ -99,54 +132,248 @@ int Learner::listenActor() {
   return 0;
 }
 
-int Learner::sendAndRecieveActor(int fd_other, R2D2Agent inferModel) {
-  size_t size;
+int Learner::listenRemoteActor() {
+  auto fdAccept = socket(AF_INET6, SOCK_STREAM, 0);
+  if (fdAccept == -1) {
+    printf("failed to socket(errno:%d, error_str:%s)\n", errno,
+           strerror(errno));
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(fdAccept, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  // IPv4からの接続も受け付ける
+  int zero = 0;
+  setsockopt(fdAccept, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(REMOTE_ACTOR_PORT);
+
+  if (bind(fdAccept, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    printf("failed to bind(errno:%d, error_str:%s)\n", errno, strerror(errno));
+    close(fdAccept);
+    return -1;
+  }
+
+  if (listen(fdAccept, SOMAXCONN) == -1) {
+    printf("failed to listen(errno:%d, error_str:%s)\n", errno,
+           strerror(errno));
+    close(fdAccept);
+    return -1;
+  }
+
+  printf("remote actor listening on port %d\n", REMOTE_ACTOR_PORT);
+
+  while (1) {
+    auto fd = accept(fdAccept, nullptr, nullptr);
+    if (fd == -1) {
+      printf("failed to accept(errno:%d, error_str:%s)\n", errno,
+             strerror(errno));
+      continue;
+    }
+    // 毎ステップのアクションをすぐに返す
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::thread(&Learner::sendAndRecieveActor, this, fd, inferModel, true)
+        .detach();
+  }
+
+  return 0;
+}
+
+// recvRequest(request)で受け取ったステップを推論し、sendAction(action)で返す
+// recvRequestがfalseを返すまで続け、処理したステップ数を返す
+template <typename Recv, typename Send>
+int64_t Learner::serveActor(int envId, R2D2Agent inferModel,
+                            const std::string &name, Recv recvRequest,
+                            Send sendAction) {
   Request request;
   int action;
-  int envId;
-  int steps = 0;
+  int64_t steps = 0;
   int prevTrainCount = 0;
 
   torch::Device device(torch::kCPU);
 
-  LocalBuffer localBuffer(state, numEnvs, device);
-  AgentInput agentInput(state, 1, 1, device);
+  placeCurrentThread(ThreadRole::Inference);
+  setTraceThreadName(name + std::to_string(envId));
 
-  // アクター番号
-  size = recv(fd_other, &envId, sizeof(envId), 0);
-
-  while (1) {
-    // データ本体の受信
-    size = recv(fd_other, &request, sizeof(request), 0);
+  LocalBuffer localBuffer(state, numEnvs, device, replay.getArena());
+  AgentInput agentInput(state, 1, 1, device);
 
+  request.envId = envId;
+  while (recvRequest(request)) {
     action = inference(inferModel, request, agentInput, device, localBuffer);
 
-    size = send(fd_other, &action, sizeof(action), 0);
-    if (size < 0) {
-      perror("send");
-    }
+    sendAction(action);
 
     steps++;
 
     if (gTrainCount != prevTrainCount && steps % 100 == 0 && envId == 0) {
+      static auto &publishLag =
+          metrics().histogram("inference/weight_publish_lag_us");
       prevTrainCount = gTrainCount;
-      inferModel.copyParams(gTrainParams, gTrainBuffers);
+      auto weights = publishedWeights();
+      inferModel.copyParams(weights->params, weights->buffers);
+      if (INFERENCE_FROZEN_GRAPH) {
+        // 作り直しの間もこのスレッドは古いグラフで推論を続ける
+        inferenceGraph.rebuildLater(
+            std::shared_ptr<const NamedParameters>(weights, &weights->params),
+            inferModel.nActions);
+      } else if (CONV_TRUNK_CHANNELS_LAST) {
+        // でき上がるまでは、どのアクターも詰め直す前の畳み込みを使う
+        inferModel.packTrunkLater(weights->params);
+      }
+      publishLag.record(nowMicros() - gPublishTime.load());
     }
   }
+  return steps;
+}
+
+int Learner::sendAndRecieveActor(int fd_other, R2D2Agent inferModel,
+                                 bool remote) {
+  static auto &remoteBytes = metrics().counter("inference/remote/bytes");
+  static auto &remoteRawBytes = metrics().counter("inference/remote/raw_bytes");
+  int envId;
+
+  // リモートのアクターは画面を差分で圧縮して送ってくる
+  std::unique_ptr<FrameDecoder> decoder;
+  if (remote) {
+    decoder = std::make_unique<FrameDecoder>();
+  }
+
+  // アクター番号
+  if (!recvAll(fd_other, &envId, sizeof(envId))) {
+    close(fd_other);
+    return -1;
+  }
+  // 推論ではアクター番号でテンソルを引くので、範囲外なら受け付けない
+  if (envId < 0 || envId >= numEnvs) {
+    printf("invalid actor id %d (num envs %d)\n", envId, numEnvs);
+    close(fd_other);
+    return -1;
+  }
+
+  // 接続ごとのファイルに、受け取ったステップを記録する
+  std::unique_ptr<ActorLogWriter> recorder;
+  if (!recordDir.empty()) {
+    auto path = recordDir + "/actor-" +
+                std::to_string(recordConnections.fetch_add(1)) + ".zst";
+    recorder = std::make_unique<ActorLogWriter>(path, envId, recordOrigin);
+  }
+
+  serveActor(
+      envId, inferModel, remote ? "remote inference " : "inference ",
+      [&](Request &request) {
+        // データ本体の受信
+        if (remote) {
+          size_t compressedSize;
+          if (!decoder->recv(fd_other, request, compressedSize)) {
+            return false;
+          }
+          remoteBytes.add(compressedSize);
+          remoteRawBytes.add(sizeof(request));
+        } else if (!recvAll(fd_other, &request, sizeof(request))) {
+          return false;
+        }
+        // 受け取ったものではなく、確かめた接続時の番号を使う
+        request.envId = envId;
+        if (recorder) {
+          recorder->write(request, traceNowNanos());
+        }
+        return true;
+      },
+      [&](int action) {
+        if (!sendAll(fd_other, &action, sizeof(action))) {
+          perror("send");
+        }
+      });
+
+  printf("actor %d closed\n", envId);
+  close(fd_other);
+  return 0;
+}
+
+void Learner::replayActorLog(const std::string &dir, bool fast) {
+  std::vector<std::string> paths;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    if (entry.path().extension() == ".zst") {
+      paths.push_back(entry.path().string());
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+  if (paths.empty()) {
+    printf("no actor log in %s\n", dir.c_str());
+    return;
+  }
+  printf("replaying %zu actor logs from %s (%s)\n", paths.size(), dir.c_str(),
+         fast ? "max speed" : "recorded speed");
+
+  std::atomic<int64_t> totalSteps = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (auto &path : paths) {
+    threads.emplace_back([&, path] {
+      ActorLogReader reader(path);
+      if (!reader.ok()) {
+        return;
+      }
+      totalSteps += serveActor(
+          reader.envId(), inferModel, "replay inference ",
+          [&](Request &request) {
+            int64_t time;
+            if (!reader.next(request, time)) {
+              return false;
+            }
+            // 記録したときと同じ間隔で流す
+            if (!fast) {
+              std::this_thread::sleep_until(start +
+                                            std::chrono::nanoseconds(time));
+            }
+            return true;
+          },
+          [](int action) {});
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  auto elapsed =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  printf("replayed %ld steps in %.1f sec (%.1f steps/sec)\n",
+         totalSteps.load(), elapsed, totalSteps / elapsed);
 }
 
 int Learner::inference(R2D2Agent &inferModel, Request &request,
                        AgentInput &agentInput, torch::Device device,
                        LocalBuffer &localBuffer) {
+  static auto &latency = metrics().histogram("inference/latency_us");
+  static auto &batchSize = metrics().histogram("inference/batch_size");
+  static auto &steps = metrics().counter("inference/steps");
+  ScopedTimer timer(latency);
+  TraceSpan span("inference");
   int action;
 
   localBuffer.setInferenceParam(request, &agentInput);
 
-  AgentOutput out = inferModel.forward(
-      agentInput.state, agentInput.prevAction, agentInput.prevReward,
-      LstmStates(agentInput.hiddenStates, agentInput.cellStates), device);
+  AgentOutput out;
+  if (INFERENCE_FROZEN_GRAPH) {
+    auto graph = inferenceGraph.get();
+    out = InferenceGraph::forward(
+        *graph, agentInput.state, agentInput.prevAction, agentInput.prevReward,
+        LstmStates(agentInput.hiddenStates, agentInput.cellStates));
+  } else {
+    out = inferModel.forward(
+        agentInput.state, agentInput.prevAction, agentInput.prevReward,
+        LstmStates(agentInput.hiddenStates, agentInput.cellStates), device);
+  }
 
   auto q = std::get<0>(out);
+  batchSize.record(agentInput.state.size(0));
+  steps.add();
 
   // 選択アクションの確率
   auto policy = torch::amax(torch::softmax(q, 2), 2);
@@ -166,43 +393,216 @@ int Learner::inference(R2D2Agent &inferModel, Request &request,
   auto ret = localBuffer.updateAndGetTransition(request, selectAction, q,
                                                 std::get<1>(out), policy);
 
+  // 優先度の計算とリプレイへの追加は、次のステップを待たせないようにタスクで行う
+  // retraceDataは次の系列で上書きされるので、複製して渡す
+  // 追加待ちが多すぎるときは、タスクを積む前に捨てる
   if (ret) {
-    auto &retraceData = localBuffer.getRetraceData();
-    auto priorities = std::get<1>(retraceLoss(
-        retraceData.action, retraceData.reward, retraceData.done,
-        retraceData.policy, retraceData.onlineQ, retraceData.targetQ, device));
+    auto storedDatas = std::make_shared<std::vector<StoredData>>(
+        localBuffer.getReplayData());
+    if (!replay.beginInsert(storedDatas->size())) {
+      return selectAction.item<int>();
+    }
 
-    replay.putReplayQueue(priorities, std::move(localBuffer.getReplayData()));
+    auto &retraceData = localBuffer.getRetraceData();
+    RetraceData data;
+    data.action = retraceData.action.clone();
+    data.reward = retraceData.reward.clone();
+    data.done = retraceData.done.clone();
+    data.policy = retraceData.policy.clone();
+    data.onlineQ = retraceData.onlineQ.clone();
+    data.targetQ = retraceData.targetQ.clone();
+    data.length = retraceData.length.clone();
+
+    scheduler().submit(TaskPriority::Normal, [this, data, storedDatas,
+                                              device] {
+      TraceSpan span("inference/priority");
+      torch::NoGradGuard no_grad;
+      auto priorities = std::get<1>(
+          retraceLoss(data.action, data.reward, data.done, data.policy,
+                      data.onlineQ, data.targetQ, device, false, data.length));
+      replay.putReplayQueue(priorities, std::move(*storedDatas));
+    });
   }
 
   return selectAction.item<int>();
 }
 
+void Learner::setTrainThreads(int n) {
+  static auto &threadsGauge = metrics().gauge("train/threads");
+
+  std::lock_guard<std::mutex> lock(trainWorkersMtx);
+  n = std::clamp(n, 1, MAX_TRAIN_THREADS);
+  int current = numTrainThreads;
+
+  for (int i = current; i < n; i++) {
+    trainWorkers[i] = std::make_unique<TrainWorker>();
+    trainWorkers[i]->thread = std::thread(&Learner::trainLoop, this, i);
+  }
+
+  for (int i = n; i < current; i++) {
+    trainWorkers[i]->stopping = true;
+  }
+  for (int i = n; i < current; i++) {
+    trainWorkers[i]->thread.join();
+    trainWorkers[i].reset();
+  }
+
+  if (n != current) {
+    printf("train threads: %d -> %d\n", current, n);
+  }
+  numTrainThreads = n;
+  threadsGauge.set(n);
+}
+
+void Learner::elasticTrainLoop() {
+  static auto &inferenceSteps = metrics().counter("inference/steps");
+
+  placeCurrentThread(ThreadRole::Background);
+  int base = numTrainThreads;
+  auto prevSteps = inferenceSteps.value();
+
+  while (1) {
+    std::this_thread::sleep_for(
+        std::chrono::seconds(TRAIN_ELASTIC_INTERVAL_SEC));
+    auto steps = inferenceSteps.value();
+    auto rate = (double)(steps - prevSteps) / TRAIN_ELASTIC_INTERVAL_SEC;
+    prevSteps = steps;
+
+    // 推論に要るコアの分だけ、借りていたコアを返す
+    auto busyCores = (int)std::ceil(rate / TRAIN_ELASTIC_STEPS_PER_CORE);
+    auto target = std::max(base, MAX_TRAIN_THREADS - busyCores);
+    if (target != numTrainThreads) {
+      setTrainThreads(target);
+    }
+  }
+}
+
+// 途中から参加する学習スレッドに、モデル、ターゲット、Adamの状態を写す
+// 写し元のスレッドは勾配の同期で止まっている
+static void copyTrainState(TrainWorker &dst, TrainWorker &src) {
+  torch::NoGradGuard no_grad;
+  dst.agent.onlineNet.copyFrom(src.agent.onlineNet);
+  dst.agent.targetNet.copyFrom(src.agent.targetNet);
+  if (CONV_TRUNK_CHANNELS_LAST) {
+    dst.agent.targetNet.packTrunk();
+  }
+
+  auto &dstParams = dst.optimizer->param_groups()[0].params();
+  auto &srcParams = src.optimizer->param_groups()[0].params();
+  for (size_t i = 0; i < srcParams.size(); i++) {
+    auto iter = src.optimizer->state().find(srcParams[i].unsafeGetTensorImpl());
+    if (iter == src.optimizer->state().end()) {
+      continue;
+    }
+    auto &state = static_cast<torch::optim::AdamParamState &>(*iter->second);
+    // このスレッドで複製して、このスレッドのNUMAノードに置く
+    auto copied = std::make_unique<torch::optim::AdamParamState>();
+    copied->exp_avg(state.exp_avg().clone());
+    copied->exp_avg_sq(state.exp_avg_sq().clone());
+    copied->step(state.step());
+    dst.optimizer->state()[dstParams[i].unsafeGetTensorImpl()] =
+        std::move(copied);
+  }
+
+  dst.stepsDone = src.stepsDone;
+  dst.agent.trainCount = src.agent.trainCount;
+}
+
 void Learner::trainLoop(int threadNum) {
   torch::Device device(torch::cuda::is_available() ? torch::kCUDA
                                                    : torch::kCPU);
-  int stepsDone = 0;
-  // std::string envent_file = "/home/yoshi/logs";
-  // tensorflow::EventsWriter writer(envent_file);
 
-  Agent &agent = gAgents[threadNum];
+  static auto &batchAssemblyTime =
+      metrics().histogram("train/batch_assembly_us");
+  static auto &forwardTime = metrics().histogram("train/forward_us");
+  static auto &gradReduceTime = metrics().histogram("train/grad_reduce_us");
+  static auto &optimizerTime = metrics().histogram("train/optimizer_us");
+  static auto &trainSteps = metrics().counter("train/steps");
+  static auto &lossGauge = metrics().gauge("train/loss");
+  static auto &fp32LossGauge = metrics().gauge("train/bf16/loss_fp32");
+  static auto &bf16LossErrorGauge =
+      metrics().gauge("train/bf16/loss_rel_error");
+
+  auto &worker = *trainWorkers[threadNum];
+  Agent &agent = worker.agent;
+  auto &stepsDone = worker.stepsDone;
+
+  // このスレッドのコアに固定し、モデルをそのNUMAノードのメモリに置き直す
+  placeCurrentThread(ThreadRole::Train, threadNum);
+  setTraceThreadName("train " + std::to_string(threadNum));
+  if (THREAD_PLACEMENT_ENABLED) {
+    agent.onlineNet.rematerialize();
+    agent.targetNet.rematerialize();
+  }
 
-  auto optimizer = torch::optim::Adam(
+  worker.optimizer = std::make_unique<torch::optim::Adam>(
       agent.onlineNet.parameters(),
       torch::optim::AdamOptions().lr(LEARNING_RATE).eps(EPSILON));
+  auto &optimizer = *worker.optimizer;
 
-  auto &sampleData = gSamples[threadNum];
-  auto &trainData = gTrainDatas[threadNum];
+  auto &sampleData = worker.sampleData;
+  auto &trainData = worker.trainData;
 
   std::deque<float> lossList;
 
+  // ステップを終えたら進め、ターゲットネットワークを更新する
+  auto finishStep = [&]() {
+    stepsDone++;
+    if (stepsDone % TARGET_UPDATE == 0) {
+      agent.targetNet.copyFrom(agent.onlineNet);
+      if (CONV_TRUNK_CHANNELS_LAST) {
+        agent.targetNet.packTrunk();
+      }
+    }
+  };
+
   if (threadNum == 0) {
-    initTotalGrad(agent.onlineNet.named_parameters(), device);
+    // 全プロセスでランク0の初期値にそろえる
+    std::vector<torch::Tensor> tensors;
+    for (auto *net : {&agent.onlineNet, &agent.targetNet}) {
+      for (auto &t : net->parameters(true)) {
+        tensors.push_back(t);
+      }
+      for (auto &t : net->buffers(true)) {
+        tensors.push_back(t);
+      }
+    }
+    broadcastFromRank0(tensors);
+
+    // 前回のチェックポイントから再開する
+    // 他のスレッドは参加するときにこのスレッドから写す
+    // 戻した重みはすぐに推論に渡し、初期値のままの方策で集めないようにする
+    if (CHECKPOINT_RESUME &&
+        checkpointer.restore(agent, optimizer, stepsDone)) {
+      publishWeights(agent.onlineNet);
+    }
+    // ターゲットネットワークは更新するまで重みが変わらないので、詰め直しておく
+    if (CONV_TRUNK_CHANNELS_LAST) {
+      agent.targetNet.packTrunk();
+    }
+  }
+
+  // スレッド0以外は他のスレッドの状態を写し、その世代の合計勾配で一歩進めて加わる
+  auto copied = joinGrad(agent.onlineNet, threadNum, device, [&](int donor) {
+    copyTrainState(worker, *trainWorkers[donor]);
+  });
+  if (copied) {
+    optimizer.step();
+    finishStep();
   }
 
   while (1) {
+    if (worker.stopping) {
+      leaveGrad();
+      return;
+    }
+
     replay.sample(sampleData);
-    toBatchedTrainData(trainData, sampleData.dataList);
+    {
+      ScopedTimer timer(batchAssemblyTime);
+      TraceSpan span("train/batch_assembly");
+      toBatchedTrainData(trainData, sampleData.dataList);
+    }
 
     // // モデルに設定するhidden stateをdetach
     trainData.hiddenStates.detach_();
@@ -214,45 +614,125 @@ void Learner::trainLoop(int threadNum) {
     // Reset gradients.
     optimizer.zero_grad();
 
-    auto burnInOnlineRet = agent.onlineNet.forward(
-        trainData.state.index({Slice(), Slice(1, 1 + REPLAY_PERIOD)}),
-        trainData.action.index({Slice(), Slice(0, REPLAY_PERIOD)}),
-        trainData.reward.index({Slice(), Slice(0, REPLAY_PERIOD)}),
-        LstmStates(trainData.hiddenStates, trainData.cellStates), device);
-    auto [onlineHiddenStates, onlineCellStates] = std::get<1>(burnInOnlineRet);
-
-    auto burnInOnTargetRet = agent.targetNet.forward(
-        trainData.state.index({Slice(), Slice(1, 1 + REPLAY_PERIOD)}),
-        trainData.action.index({Slice(), Slice(0, REPLAY_PERIOD)}),
-        trainData.reward.index({Slice(), Slice(0, REPLAY_PERIOD)}),
-        LstmStates(trainData.hiddenStates, trainData.cellStates), device);
-
-    // ここから勾配を使う
-    // backwardではここまでさかのぼる
-    onlineHiddenStates.requires_grad_(true);
-    onlineCellStates.requires_grad_(true);
-    agent.onlineNet.requiresGrad_(true);
-
-    auto onlineRet = agent.onlineNet.forward(
-        trainData.state.index({Slice(), Slice(REPLAY_PERIOD, None)}),
-        trainData.action.index({Slice(), Slice(REPLAY_PERIOD - 1, -1)}),
-        trainData.reward.index({Slice(), Slice(REPLAY_PERIOD - 1, -1)}),
-        LstmStates(onlineHiddenStates, onlineCellStates), device);
-
-    auto targetRet = agent.targetNet.forward(
-        trainData.state.index({Slice(), Slice(REPLAY_PERIOD, None)}),
-        trainData.action.index({Slice(), Slice(REPLAY_PERIOD - 1, -1)}),
-        trainData.reward.index({Slice(), Slice(REPLAY_PERIOD - 1, -1)}),
-        std::get<1>(burnInOnTargetRet), device);
-
-    auto [loss, priorities] = retraceLoss(
+    // 訓練部分の有効なステップ数
+    // バーンイン部分は常に有効な系列だけが保存されている
+    auto traceLength = trainData.length - REPLAY_PERIOD;
+
+    // ターゲット側のバーンインから学習部分まで
+    auto forwardTarget = [&]() {
+      auto burnInTargetRet = agent.targetNet.forward(
+          trainData.state.index({Slice(), Slice(1, 1 + REPLAY_PERIOD)}),
+          trainData.action.index({Slice(), Slice(0, REPLAY_PERIOD)}),
+          trainData.reward.index({Slice(), Slice(0, REPLAY_PERIOD)}),
+          LstmStates(trainData.hiddenStates, trainData.cellStates), device);
+
+      auto targetRet = agent.targetNet.forward(
+          trainData.state.index({Slice(), Slice(REPLAY_PERIOD, None)}),
+          trainData.action.index({Slice(), Slice(REPLAY_PERIOD - 1, -1)}),
+          trainData.reward.index({Slice(), Slice(REPLAY_PERIOD - 1, -1)}),
+          std::get<1>(burnInTargetRet), device, traceLength);
+
+      // リトレースと損失はFP32で計算する
+      return std::get<0>(targetRet).to(torch::kFloat);
+    };
+
+    // バーンインから損失計算の直前まで
+    // BF16の検証では同じバッチでもう一度呼ぶ
+    auto forwardQ = [&]() {
+      // ターゲット側はオンライン側と独立で勾配も要らないので、
+      // interopのスレッドで並行に計算し、損失の前に合流する
+      torch::Tensor targetQ;
+      std::promise<void> targetDone;
+      auto targetFuture = targetDone.get_future();
+      // タスクはこのフレームを参照するので、オンライン側で例外が出ても待ってから抜ける
+      FutureJoinGuard targetJoin(targetFuture);
+      if (TRAIN_CONCURRENT_TARGET) {
+        auto bf16 = at::autocast::is_cpu_enabled();
+        at::launch([&, bf16] {
+          try {
+            TraceSpan span("train/target_forward");
+            torch::NoGradGuard no_grad;
+            Bf16AutocastGuard autocast(bf16);
+            targetQ = forwardTarget();
+            targetDone.set_value();
+          } catch (...) {
+            targetDone.set_exception(std::current_exception());
+          }
+        });
+      }
+
+      AgentOutput burnInOnlineRet;
+      {
+        TraceSpan span("train/burn_in");
+        burnInOnlineRet = agent.onlineNet.forward(
+            trainData.state.index({Slice(), Slice(1, 1 + REPLAY_PERIOD)}),
+            trainData.action.index({Slice(), Slice(0, REPLAY_PERIOD)}),
+            trainData.reward.index({Slice(), Slice(0, REPLAY_PERIOD)}),
+            LstmStates(trainData.hiddenStates, trainData.cellStates), device);
+      }
+      auto [onlineHiddenStates, onlineCellStates] =
+          std::get<1>(burnInOnlineRet);
+
+      // ここから勾配を使う
+      // backwardではここまでさかのぼる
+      onlineHiddenStates.requires_grad_(true);
+      onlineCellStates.requires_grad_(true);
+      agent.onlineNet.requiresGrad_(true);
+
+      auto onlineRet = agent.onlineNet.forward(
+          trainData.state.index({Slice(), Slice(REPLAY_PERIOD, None)}),
+          trainData.action.index({Slice(), Slice(REPLAY_PERIOD - 1, -1)}),
+          trainData.reward.index({Slice(), Slice(REPLAY_PERIOD - 1, -1)}),
+          LstmStates(onlineHiddenStates, onlineCellStates), device,
+          traceLength);
+
+      if (TRAIN_CONCURRENT_TARGET) {
+        TraceSpan span("train/target_join");
+        targetFuture.get();
+      } else {
+        targetQ = forwardTarget();
+      }
+
+      return std::make_tuple(std::get<0>(onlineRet).to(torch::kFloat),
+                             targetQ);
+    };
+
+    auto traceAction =
         trainData.action.index({Slice(), Slice(REPLAY_PERIOD, None)})
-            .unsqueeze(2),
+            .unsqueeze(2);
+    auto traceReward =
         trainData.reward.index({Slice(), Slice(REPLAY_PERIOD, None)})
-            .squeeze(-1),
-        trainData.done.index({Slice(), Slice(REPLAY_PERIOD, None)}),
-        trainData.policy.index({Slice(), Slice(REPLAY_PERIOD, None)}),
-        std::get<0>(onlineRet), std::get<0>(targetRet), device, true);
+            .squeeze(-1);
+    auto traceDone =
+        trainData.done.index({Slice(), Slice(REPLAY_PERIOD, None)});
+    auto tracePolicy =
+        trainData.policy.index({Slice(), Slice(REPLAY_PERIOD, None)});
+
+    auto forwardStart = nowMicros();
+    torch::Tensor onlineQ, targetQ;
+    {
+      TraceSpan span("train/forward");
+      Bf16AutocastGuard autocast(TRAIN_BF16 && device.is_cpu());
+      std::tie(onlineQ, targetQ) = forwardQ();
+    }
+    forwardTime.record(nowMicros() - forwardStart);
+
+    auto [loss, priorities] =
+        retraceLoss(traceAction, traceReward, traceDone, tracePolicy, onlineQ,
+                    targetQ, device, true, traceLength);
+
+    // 同じ重みと同じバッチでFP32の損失を計算し、BF16との差を記録する
+    if (TRAIN_BF16 && threadNum == 0 &&
+        stepsDone % TRAIN_BF16_VALIDATE_INTERVAL == 0) {
+      torch::NoGradGuard no_grad;
+      auto [fp32OnlineQ, fp32TargetQ] = forwardQ();
+      auto fp32Loss = std::get<0>(
+          retraceLoss(traceAction, traceReward, traceDone, tracePolicy,
+                      fp32OnlineQ, fp32TargetQ, device, false, traceLength));
+      fp32LossGauge.set(fp32Loss);
+      bf16LossErrorGauge.set(std::abs(loss - fp32Loss) /
+                             std::max(std::abs(fp32Loss), 1e-8f));
+    }
 
     // std::cout << "----------------------" << std::endl;
     // for (auto &val : agent.onlineNet.named_parameters()) {
@@ -269,15 +749,24 @@ void Learner::trainLoop(int threadNum) {
     // }
 
     // 勾配を集計して設定
-    updateGrad(agent.onlineNet, threadNum);
+    {
+      ScopedTimer timer(gradReduceTime);
+      TraceSpan span("train/update_grad");
+      updateGrad(agent.onlineNet, threadNum);
+    }
 
     // Update the parameters based on the calculated gradients.
-    optimizer.step();
+    {
+      ScopedTimer timer(optimizerTime);
+      TraceSpan span("train/optimizer_step");
+      optimizer.step();
+    }
+    trainSteps.add();
 
     if (threadNum == 0) {
-      gTrainParams = agent.onlineNet.named_parameters(true);
-      gTrainBuffers = agent.onlineNet.named_buffers(true);
       agent.trainCount++;
+      publishWeights(agent.onlineNet);
+      lossGauge.set(loss);
 
       lossList.push_back(loss);
       if (lossList.size() > 100) {
@@ -285,59 +774,33 @@ void Learner::trainLoop(int threadNum) {
       }
     }
 
-    replay.updatePriorities(sampleData.labelList, sampleData.indexList,
-                            priorities);
-
-    // tensorflow::Event event;
-    // tensorflow::Summary::Value* summ_val =
-    // event.mutable_summary()->add_value(); event.set_step(stepsDone);
-    // summ_val->set_tag("loss");
-    // summ_val->set_simple_value(loss);
-    // writer->WriteEvent(event);
-
-    stepsDone++;
-
-    // ターゲットネットワーク更新
-    if (stepsDone % TARGET_UPDATE == 0) {
-      agent.targetNet.copyFrom(agent.onlineNet);
+    // バッチは長さ順に並べ替えてあるので、優先度の行に合わせる
+    {
+      TraceSpan span("train/update_priorities");
+      std::array<int, BATCH_SIZE> rowLabels, rowIndexes;
+      for (int row = 0; row < BATCH_SIZE; row++) {
+        rowLabels[row] = sampleData.labelList[trainData.order[row]];
+        rowIndexes[row] = sampleData.indexList[trainData.order[row]];
+      }
+      replay.updatePriorities(rowLabels, rowIndexes, priorities);
     }
 
+    finishStep();
+
     if (threadNum == 0 /* && (stepsDone % 5 == 0)*/) {
 
       std::cout << "loss = "
                 << std::accumulate(lossList.begin(), lossList.end(), 0.0) /
                        lossList.size()
-                << ", steps = " << stepsDone * NUM_TRAIN_THREADS << std::endl;
+                << ", steps = " << stepsDone * numTrainThreads << std::endl;
     }
 
-    // モデル保存
-    if (threadNum == 0 && (stepsDone % 1000 == 0)) {
-      agent.onlineNet.saveStateDict("model.pt");
+    // モデル保存（書き出しはチェックポイントスレッドで行う）
+    // 複数プロセスのときはランク0だけが書き出す
+    if (threadNum == 0 && distributedRank() == 0 &&
+        (stepsDone % CHECKPOINT_INTERVAL == 0)) {
+      checkpointer.save(agent, optimizer, stepsDone);
     }
     std::cout << "stepsDone " << stepsDone << std::endl;
   }
 }
-
-int main(void) {
-  int ret_code = 0;
-  auto stateTensor =
-      torch::zeros({1, 84, 84}, torch::TensorOptions().dtype(torch::kUInt8));
-  int actionSize = 9;
-  int numEnvs = NUM_ENVS;
-
-  // 訓練モデルのパラメーターを合わせる
-  for (auto i = 1; i < NUM_TRAIN_THREADS; i++) {
-    gAgents[i].onlineNet.copyFrom(gAgents[0].onlineNet);
-    gAgents[i].targetNet.copyFrom(gAgents[0].targetNet);
-  }
-
-  Learner learner(stateTensor, actionSize, numEnvs, TRACE_LENGTH, REPLAY_PERIOD,
-                  REPLAY_BUFFER_SIZE);
-
-  // actorからのリクエスト受付
-  auto inferThread = std::thread(&Learner::listenActor, &learner);
-
-  inferThread.join();
-
-  return EXIT_SUCCESS;
-}
@@ -1,5 +1,6 @@
 #include "LocalBuffer.hpp"
 #include "Utils.hpp"
+#include <numeric>
 
 using namespace torch::indexing;
 
@@ -17,37 +18,83 @@ void LocalBuffer::setInferenceParam(Request &request, AgentInput *inferData) {
   inferData->cellStates = prevCellStates.detach();
 }
 
-void LocalBuffer::setRetaceData() {
+void LocalBuffer::setRetaceData(int length) {
   retraceData.action.index_put_(
-      {retraceIndex}, torch::from_blob(transition.action + REPLAY_PERIOD,
+      {retraceIndex}, torch::from_blob(sequence.action + REPLAY_PERIOD,
                                        {1 + TRACE_LENGTH, 1}, torch::kUInt8)
                           .to(torch::kInt64)
                           .to(device));
   retraceData.reward.index_put_(
-      {retraceIndex}, torch::from_blob(transition.reward + REPLAY_PERIOD,
+      {retraceIndex}, torch::from_blob(sequence.reward + REPLAY_PERIOD,
                                        {1 + TRACE_LENGTH}, torch::kFloat32)
                           .to(device));
   retraceData.done.index_put_({retraceIndex},
-                              torch::from_blob(transition.done + REPLAY_PERIOD,
+                              torch::from_blob(sequence.done + REPLAY_PERIOD,
                                                {1 + TRACE_LENGTH}, torch::kBool)
                                   .to(device));
   retraceData.policy.index_put_(
-      {retraceIndex}, torch::from_blob(transition.policy + REPLAY_PERIOD,
+      {retraceIndex}, torch::from_blob(sequence.policy + REPLAY_PERIOD,
                                        {1 + TRACE_LENGTH}, torch::kFloat32)
                           .to(device));
   retraceData.onlineQ.index_put_(
       {retraceIndex},
-      torch::from_blob(transition.q + REPLAY_PERIOD,
+      torch::from_blob(sequence.q + REPLAY_PERIOD,
                        {1 + TRACE_LENGTH, ACTION_SIZE}, torch::kFloat32)
           .to(device));
   retraceData.targetQ.index_put_(
       {retraceIndex},
-      torch::from_blob(transition.q + REPLAY_PERIOD,
+      torch::from_blob(sequence.q + REPLAY_PERIOD,
                        {1 + TRACE_LENGTH, ACTION_SIZE}, torch::kFloat32)
           .to(device));
+  retraceData.length.index_put_({retraceIndex}, length - REPLAY_PERIOD);
   retraceIndex++;
 }
 
+// リングから系列順に並べ直して、圧縮したものを保存する
+// 画面はコピーせず、リング上のポインタのまま圧縮に渡す
+void LocalBuffer::emitSequence(int length) {
+  static const uint8_t zeroState[STATE_SIZE] = {0};
+
+  for (int i = 0; i < SEQ_LENGTH; i++) {
+    // エピソード終了後はゼロ埋め
+    if (i >= length) {
+      view.state[i] = zeroState;
+      sequence.action[i] = 0;
+      sequence.reward[i] = 0;
+      sequence.done[i] = 0;
+      sequence.policy[i] = 0;
+      std::fill(sequence.q[i], sequence.q[i] + ACTION_SIZE, 0);
+      continue;
+    }
+
+    auto pos = (start + i) % SEQ_LENGTH;
+    view.state[i] = stateRing[pos];
+    sequence.action[i] = stepRing.action[pos];
+    sequence.reward[i] = stepRing.reward[pos];
+    sequence.done[i] = stepRing.done[pos];
+    sequence.policy[i] = stepRing.policy[pos];
+    std::copy(stepRing.q[pos], stepRing.q[pos] + ACTION_SIZE, sequence.q[i]);
+  }
+  view.action = sequence.action;
+  view.reward = sequence.reward;
+  view.policy = sequence.policy;
+  view.done = sequence.done;
+  view.hiddenStates = burnInHiddenStates;
+  view.cellStates = burnInCellStates;
+  view.length = length;
+
+  // 報酬合計を取得
+  auto totalReward =
+      std::accumulate(sequence.reward, sequence.reward + length, 0.0);
+
+  // リトレースにデータ設定
+  setRetaceData(length);
+
+  // 遷移データを圧縮
+  storedDatas.emplace_back(std::move(compress(view, &arenaWriter)));
+  storedDatas.back().reward = totalReward;
+}
+
 bool LocalBuffer::updateAndGetTransition(Request &request,
                                          torch::Tensor &actionTensor,
                                          torch::Tensor &q,
@@ -57,34 +104,36 @@ bool LocalBuffer::updateAndGetTransition(Request &request,
   prevAction = action;
   prevReward = request.reward;
 
-  std::copy(request.state, request.state + STATE_SIZE, transition.state[index]);
-  transition.action[index] = action;
-  transition.reward[index] = request.reward;
-  transition.done[index] = request.done;
-
-  // ここで受け取るLSTM状態は、推論後の最新のものなので、一つ前の状態を設定する
-  auto prevHiddenStatesBuf = prevHiddenStates.contiguous().data_ptr<float>();
-  std::copy(prevHiddenStatesBuf, prevHiddenStatesBuf + LSTM_STATE_SIZE,
-            transition.hiddenStates[index]);
-  auto prevCellStatesBuf = prevCellStates.contiguous().data_ptr<float>();
-  std::copy(prevCellStatesBuf, prevCellStatesBuf + LSTM_STATE_SIZE,
-            transition.cellStates[index]);
+  auto pos = (start + index) % SEQ_LENGTH;
+  std::copy(request.state, request.state + STATE_SIZE, stateRing[pos]);
+  stepRing.action[pos] = action;
+  stepRing.reward[pos] = request.reward;
+  stepRing.done[pos] = request.done;
 
   auto qBuf = q.contiguous().data_ptr<float>();
-  std::copy(qBuf, qBuf + ACTION_SIZE, transition.q[index]);
-  transition.policy[index] = policy.item<float>();
+  std::copy(qBuf, qBuf + ACTION_SIZE, stepRing.q[pos]);
+  stepRing.policy[pos] = policy.item<float>();
+
+  // ここで受け取るLSTM状態は、推論後の最新のものなので、一つ前の状態を設定する
+  // 保存が必要なのは、この系列と次の系列のバーンイン開始位置の状態だけ
+  if (index == 1 || index == SEQ_LENGTH - REPLAY_PERIOD + 1) {
+    auto next = index != 1;
+    auto prevHiddenStatesBuf = prevHiddenStates.contiguous().data_ptr<float>();
+    std::copy(prevHiddenStatesBuf, prevHiddenStatesBuf + LSTM_STATE_SIZE,
+              next ? nextBurnInHiddenStates : burnInHiddenStates);
+    auto prevCellStatesBuf = prevCellStates.contiguous().data_ptr<float>();
+    std::copy(prevCellStatesBuf, prevCellStatesBuf + LSTM_STATE_SIZE,
+              next ? nextBurnInCellStates : burnInCellStates);
+  }
 
+  // 推論の出力は毎回新しいテンソルなので、複製せずに持っておく
   auto [hiddenStates, cellStates] = lstmStates;
-  prevHiddenStates = hiddenStates.detach().clone();
-  prevCellStates = cellStates.detach().clone();
+  prevHiddenStates = hiddenStates.detach();
+  prevCellStates = cellStates.detach();
 
   index++;
 
   if (index == SEQ_LENGTH || request.done) {
-    // 報酬合計を取得
-    auto totalReward =
-        std::accumulate(transition.reward, transition.reward + index, 0.0);
-
     if (request.done) {
       prevHiddenStates = torch::zeros({1, LSTM_STATE_SIZE});
       prevCellStates = torch::zeros({1, LSTM_STATE_SIZE});
@@ -93,57 +142,21 @@ bool LocalBuffer::updateAndGetTransition(Request &request,
       prevReward = 0;
 
       if (index > REPLAY_PERIOD + 1) {
-        // 現在位置（次の現在位置）から最後までゼロクリア
-        std::fill(transition.state[index], transition.state[SEQ_LENGTH], 0);
-        std::fill(&transition.action[index], &transition.action[SEQ_LENGTH], 0);
-        std::fill(&transition.reward[index], &transition.reward[SEQ_LENGTH], 0);
-        std::fill(&transition.done[index], &transition.done[SEQ_LENGTH], 0);
-        std::fill(&transition.policy[index], &transition.policy[SEQ_LENGTH], 0);
-        std::fill(transition.q[index], transition.q[SEQ_LENGTH], 0);
-
-        // リトレースにデータ設定
-        setRetaceData();
-
-        // 遷移データを圧縮
-        ReplayData &replayData = transition.getReplayData();
-        storedDatas.emplace_back(std::move(compress(replayData)));
-        storedDatas[retraceIndex].reward = totalReward;
+        emitSequence(index);
       }
       // 現在位置をリセット
+      start = 0;
       index = 0;
     } else {
-      // リトレースにデータ設定
-      setRetaceData();
-
-      // 遷移データを圧縮
-      ReplayData &replayData = transition.getReplayData();
-      storedDatas.emplace_back(std::move(compress(replayData)));
-      storedDatas[retraceIndex].reward = totalReward;
-
-      // 末尾からバーンイン期間分を先頭へ移動
-      auto a = &transition.action[SEQ_LENGTH] - REPLAY_PERIOD;
-      auto b = &transition.action;
-      auto c = transition.state;
-
-      std::move(transition.state[SEQ_LENGTH] - REPLAY_PERIOD,
-                transition.state[SEQ_LENGTH], (uint8_t *)transition.state);
-      std::move(&transition.action[SEQ_LENGTH] - REPLAY_PERIOD,
-                &transition.action[SEQ_LENGTH], (uint8_t *)transition.action);
-      std::move(&transition.reward[SEQ_LENGTH] - REPLAY_PERIOD,
-                &transition.reward[SEQ_LENGTH], (float *)transition.reward);
-      std::move(&transition.done[SEQ_LENGTH] - REPLAY_PERIOD,
-                &transition.done[SEQ_LENGTH], (bool *)transition.done);
-      std::move(&transition.policy[SEQ_LENGTH] - REPLAY_PERIOD,
-                &transition.policy[SEQ_LENGTH], (float *)transition.policy);
-      std::move(transition.hiddenStates[SEQ_LENGTH] - REPLAY_PERIOD,
-                transition.hiddenStates[SEQ_LENGTH],
-                (float *)transition.hiddenStates);
-      std::move(transition.cellStates[SEQ_LENGTH] - REPLAY_PERIOD,
-                transition.cellStates[SEQ_LENGTH],
-                (float *)transition.cellStates);
-      std::move(transition.q[SEQ_LENGTH] - REPLAY_PERIOD,
-                transition.q[SEQ_LENGTH], (float *)transition.q);
+      emitSequence(index);
+
+      // 末尾のバーンイン期間分が次の系列の先頭になる
+      start = (start + SEQ_LENGTH - REPLAY_PERIOD) % SEQ_LENGTH;
       index = REPLAY_PERIOD;
+      std::copy(nextBurnInHiddenStates,
+                nextBurnInHiddenStates + LSTM_STATE_SIZE, burnInHiddenStates);
+      std::copy(nextBurnInCellStates, nextBurnInCellStates + LSTM_STATE_SIZE,
+                burnInCellStates);
     }
   }
 
@@ -0,0 +1,188 @@
+#include "Metrics.hpp"
+#include "ThreadPlacement.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+Histogram::Snapshot Histogram::snapshot() const {
+  Snapshot snap;
+  for (auto &shard : shards) {
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+      auto n = shard.counts[i].load(std::memory_order_relaxed);
+      snap.counts[i] += n;
+      snap.count += n;
+    }
+    snap.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  return snap;
+}
+
+// バケット内の中央の値を返す
+int64_t Histogram::Snapshot::percentile(double p) const {
+  if (count == 0) {
+    return 0;
+  }
+  auto rank = (int64_t)(p * count);
+  int64_t seen = 0;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen > rank) {
+      auto low = lowerBound(i);
+      auto high = i + 1 < NUM_BUCKETS ? lowerBound(i + 1) : low;
+      return (low + high) / 2;
+    }
+  }
+  return lowerBound(NUM_BUCKETS - 1);
+}
+
+Histogram::Snapshot
+Histogram::Snapshot::operator-(const Snapshot &other) const {
+  Snapshot diff;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    diff.counts[i] = counts[i] - other.counts[i];
+  }
+  diff.count = count - other.count;
+  diff.sum = sum - other.sum;
+  return diff;
+}
+
+Counter &Metrics::counter(const std::string &name) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto &ptr = counters[name];
+  if (!ptr) {
+    ptr = std::make_unique<Counter>();
+  }
+  return *ptr;
+}
+
+Gauge &Metrics::gauge(const std::string &name) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto &ptr = gauges[name];
+  if (!ptr) {
+    ptr = std::make_unique<Gauge>();
+  }
+  return *ptr;
+}
+
+Histogram &Metrics::histogram(const std::string &name) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto &ptr = histograms[name];
+  if (!ptr) {
+    ptr = std::make_unique<Histogram>();
+  }
+  return *ptr;
+}
+
+void Metrics::onFlush(std::function<void()> hook) {
+  std::lock_guard<std::mutex> lock(mtx);
+  flushHooks.push_back(std::move(hook));
+}
+
+namespace {
+
+// Prometheusのメトリクス名に使えない文字を置き換える
+std::string promName(const std::string &name) {
+  auto ret = "learner_" + name;
+  std::replace_if(
+      ret.begin(), ret.end(), [](char c) { return !isalnum(c) && c != '_'; },
+      '_');
+  return ret;
+}
+
+} // namespace
+
+void Metrics::flush(const std::string &dir) {
+  // フックからメトリクスを登録できるように、ロックの外で呼ぶ
+  std::vector<std::function<void()>> hooks;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    hooks = flushHooks;
+  }
+  for (auto &hook : hooks) {
+    hook();
+  }
+
+  std::lock_guard<std::mutex> lock(mtx);
+  if (!eventWriter) {
+    eventWriter = std::make_unique<EventWriter>(dir);
+  }
+
+  std::vector<std::pair<std::string, float>> scalars;
+  std::string prom;
+
+  for (auto &[name, counter] : counters) {
+    auto value = counter->value();
+    scalars.emplace_back(name, value);
+    auto metricName = promName(name);
+    prom += "# TYPE " + metricName + " counter\n";
+    prom += metricName + " " + std::to_string(value) + "\n";
+  }
+
+  for (auto &[name, gauge] : gauges) {
+    auto value = gauge->value();
+    scalars.emplace_back(name, value);
+    auto metricName = promName(name);
+    prom += "# TYPE " + metricName + " gauge\n";
+    prom += metricName + " " + std::to_string(value) + "\n";
+  }
+
+  // TensorBoardには前回のflushからの区間の値、Prometheusには累積の値を出す
+  for (auto &[name, histogram] : histograms) {
+    auto snap = histogram->snapshot();
+    auto window = snap - prevSnapshots[name];
+    prevSnapshots[name] = snap;
+
+    if (window.count > 0) {
+      scalars.emplace_back(name + "/p50", window.percentile(0.5));
+      scalars.emplace_back(name + "/p99", window.percentile(0.99));
+      scalars.emplace_back(name + "/p999", window.percentile(0.999));
+      scalars.emplace_back(name + "/mean", window.mean());
+    }
+    scalars.emplace_back(name + "/count", window.count);
+
+    auto metricName = promName(name);
+    prom += "# TYPE " + metricName + " summary\n";
+    for (auto q : {0.5, 0.99, 0.999}) {
+      char quantile[16];
+      sprintf(quantile, "%g", q);
+      prom += metricName + "{quantile=\"" + quantile + "\"} " +
+              std::to_string(snap.percentile(q)) + "\n";
+    }
+    prom += metricName + "_sum " + std::to_string(snap.sum) + "\n";
+    prom += metricName + "_count " + std::to_string(snap.count) + "\n";
+  }
+
+  int64_t step = 0;
+  auto iter = counters.find("train/steps");
+  if (iter != counters.end()) {
+    step = iter->second->value();
+  }
+  eventWriter->writeScalars(scalars, step);
+
+  // 読み手が書きかけのファイルを見ないようにrenameで置き換える
+  auto path = std::filesystem::path(dir) / "metrics.prom";
+  auto tmp = path;
+  tmp += ".tmp";
+  {
+    std::ofstream file(tmp);
+    file << prom;
+  }
+  std::filesystem::rename(tmp, path);
+}
+
+Metrics &metrics() {
+  static Metrics instance;
+  return instance;
+}
+
+void startMetricsReporter(const std::string &dir, int intervalSec) {
+  std::thread([dir, intervalSec] {
+    placeCurrentThread(ThreadRole::Background);
+    while (1) {
+      std::this_thread::sleep_for(std::chrono::seconds(intervalSec));
+      metrics().flush(dir);
+    }
+  }).detach();
+}
@@ -11,14 +11,54 @@ torch::Dimname dimnameFromString(const std::string &str) {
 using namespace torch::indexing;
 std::mutex mtx;
 
+torch::Tensor R2D2Agent::convTrunk(torch::Tensor f,
+                                  const torch::Device device) {
+  if (CONV_TRUNK_CHANNELS_LAST && device.is_cpu()) {
+    // 勾配が要らず、重みが詰め直したときのままなら、融合したconv + reluを使う
+    if (!torch::GradMode::is_enabled() || !conv1->weight.requires_grad()) {
+      if (auto packed = packedTrunk->get(trunkParams())) {
+        return PackedConvTrunk::forward(*packed, f);
+      }
+    }
+    // NHWCにしておくと、oneDNNの畳み込みが並べ替えなしで使われる
+    // 逆伝播もchannels-lastのまま計算される
+    f = f.contiguous(torch::MemoryFormat::ChannelsLast);
+  }
+  f = conv1->forward(f);
+  f = torch::relu(f);
+  f = conv2->forward(f);
+  f = torch::relu(f);
+  f = conv3->forward(f);
+  f = torch::relu(f);
+  return f.contiguous().view({f.size(0), -1});
+}
+
 AgentOutput R2D2Agent::forward(const torch::Tensor x,
                                const torch::Tensor prevAction,
                                const torch::Tensor prevReward,
                                const LstmStates initialLstmStates,
-                               const torch::Device device) {
+                               const torch::Device device,
+                               const torch::Tensor lengths) {
   auto batchSize = x.size(0);
   auto seqLen = x.size(1);
 
+  // ステップごとに、まだ有効な行数
+  // 長い順に並んでいるので、有効な行は常に先頭からactiveRows[i]行
+  std::vector<int64_t> activeRows(seqLen, batchSize);
+  bool packed = false;
+  if (lengths.defined()) {
+    auto lens = lengths.contiguous();
+    auto *lensPtr = lens.data_ptr<int64_t>();
+    for (long i = 0; i < seqLen; i++) {
+      int64_t rows = 0;
+      while (rows < batchSize && lensPtr[rows] > i) {
+        rows++;
+      }
+      activeRows[i] = rows;
+    }
+    packed = activeRows.back() < batchSize;
+  }
+
   torch::Tensor out, feature, feature1, feature2;
   auto [prevHiddenState, prevCellState] = initialLstmStates;
   // auto lstmStatesStack =
@@ -26,14 +66,22 @@ AgentOutput R2D2Agent::forward(const torch::Tensor x,
 
   // batch * seq, channel, w, h
   feature = x.contiguous().view({-1, x.sizes()[2], x.sizes()[3], x.sizes()[4]});
-  feature = conv1->forward(feature);
-  feature = torch::relu(feature);
-  feature = conv2->forward(feature);
-  feature = torch::relu(feature);
-  feature = conv3->forward(feature);
-  feature = torch::relu(feature);
+  if (packed) {
+    // 有効な画面だけを畳み込み、ゼロ埋め部分の特徴はゼロにする
+    auto valid = (torch::arange(seqLen).unsqueeze(0) < lengths.unsqueeze(1))
+                     .view(-1)
+                     .nonzero()
+                     .squeeze(1)
+                     .to(device);
+    auto validFeature = convTrunk(feature.index_select(0, valid), device);
+    feature = torch::zeros({batchSize * seqLen, validFeature.size(1)},
+                           validFeature.options())
+                  .index_copy(0, valid, validFeature);
+  } else {
+    feature = convTrunk(feature, device);
+  }
 
-  feature = feature.contiguous().view({batchSize, seqLen, -1});
+  feature = feature.view({batchSize, seqLen, -1});
 
   // batch, (burn_in + )seq, actions
   auto prevActionOneHot = torch::one_hot(prevAction, nActions);
@@ -44,12 +92,30 @@ AgentOutput R2D2Agent::forward(const torch::Tensor x,
   std::vector<torch::Tensor> lstmOutputs(
       seqLen, torch::empty({batchSize, LSTM_STATE_SIZE}).to(device));
   for (long i = 0; i < seqLen; i++) {
-    auto [newHiddenState, newCellState] =
-        lstmCell(lstmInputs.index({Slice(), i, Slice()}),
-                 std::make_tuple(prevHiddenState, prevCellState));
-    lstmOutputs[i] = newCellState;
-    prevHiddenState = newHiddenState;
-    prevCellState = newCellState;
+    auto rows = activeRows[i];
+    if (rows == batchSize) {
+      auto [newHiddenState, newCellState] =
+          lstmCell(lstmInputs.index({Slice(), i, Slice()}),
+                   std::make_tuple(prevHiddenState, prevCellState));
+      lstmOutputs[i] = newCellState;
+      prevHiddenState = newHiddenState;
+      prevCellState = newCellState;
+    } else if (rows == 0) {
+      lstmOutputs[i] = torch::zeros_like(prevCellState);
+    } else {
+      // 終わった系列の状態はそのまま持ち越し、出力はゼロにする
+      auto [newHiddenState, newCellState] =
+          lstmCell(lstmInputs.index({Slice(0, rows), i, Slice()}),
+                   std::make_tuple(prevHiddenState.narrow(0, 0, rows),
+                                   prevCellState.narrow(0, 0, rows)));
+      lstmOutputs[i] = torch::cat(
+          {newCellState, torch::zeros({batchSize - rows, LSTM_STATE_SIZE},
+                                      newCellState.options())});
+      prevHiddenState = torch::cat(
+          {newHiddenState, prevHiddenState.narrow(0, rows, batchSize - rows)});
+      prevCellState = torch::cat(
+          {newCellState, prevCellState.narrow(0, rows, batchSize - rows)});
+    }
   }
   auto lstmStatesStack =
       torch::stack(lstmOutputs, 0).permute({1, 0, 2}).to(device);
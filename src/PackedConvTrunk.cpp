@@ -0,0 +1,141 @@
+#include "PackedConvTrunk.hpp"
+#include "Common.hpp"
+#include "Metrics.hpp"
+#include "TaskScheduler.hpp"
+#include <cstdio>
+
+namespace {
+
+const char *TRUNK_SOURCE = R"JIT(
+def forward(self, x: Tensor) -> Tensor:
+    f = torch.relu(torch.conv2d(x, self.conv1_weight, self.conv1_bias, [4, 4]))
+    f = torch.relu(torch.conv2d(f, self.conv2_weight, self.conv2_bias, [2, 2]))
+    f = torch.relu(torch.conv2d(f, self.conv3_weight, self.conv3_bias, [1, 1]))
+    return f.flatten(1)
+)JIT";
+
+const char *TRUNK_PARAM_NAMES[] = {"conv1_weight", "conv1_bias",
+                                   "conv2_weight", "conv2_bias",
+                                   "conv3_weight", "conv3_bias"};
+const int64_t TRUNK_STRIDES[] = {4, 2, 1};
+
+} // namespace
+
+void PackedConvTrunk::rebuild(const std::vector<torch::Tensor> &params) {
+  // 作っている間に重みが更新されたら、次のgetで古いと分かるようにする
+  rebuild(params, stamp(params));
+}
+
+void PackedConvTrunk::rebuildLater(std::vector<torch::Tensor> params,
+                                   const std::vector<torch::Tensor> &live) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    pending = std::make_unique<Pending>();
+    pending->params = std::move(params);
+    pending->stamps = stamp(live);
+    if (rebuilding) {
+      return;
+    }
+    rebuilding = true;
+  }
+
+  scheduler().submit(TaskPriority::Low, [self = shared_from_this()] {
+    while (1) {
+      std::unique_ptr<Pending> next;
+      {
+        std::lock_guard<std::mutex> lock(self->mtx);
+        next = std::move(self->pending);
+        if (!next) {
+          self->rebuilding = false;
+          return;
+        }
+      }
+      self->rebuild(next->params, std::move(next->stamps));
+    }
+  });
+}
+
+void PackedConvTrunk::rebuild(const std::vector<torch::Tensor> &params,
+                              std::vector<Stamp> current) {
+  static auto &errorGauge = metrics().gauge("model/packed_trunk_rel_error");
+  torch::NoGradGuard no_grad;
+
+  auto packed = build(params);
+
+  auto x = torch::rand({8, params[0].size(1), 84, 84});
+  auto expected = x;
+  for (int i = 0; i < 3; i++) {
+    expected = torch::relu(torch::conv2d(expected, params[i * 2],
+                                         params[i * 2 + 1], TRUNK_STRIDES[i]));
+  }
+  expected = expected.flatten(1);
+  auto error = ((forward(*packed, x) - expected).abs().max() /
+                expected.abs().max().clamp_min(1e-8))
+                   .item<float>();
+  errorGauge.set(error);
+  if (error > CONV_TRUNK_TOLERANCE) {
+    printf("packed conv trunk is not used (relative error %g)\n", error);
+    packed = nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(mtx);
+  module = std::move(packed);
+  stamps = std::move(current);
+}
+
+std::shared_ptr<torch::jit::Module>
+PackedConvTrunk::build(const std::vector<torch::Tensor> &params) {
+  static auto &buildTime = metrics().histogram("model/packed_trunk_build_us");
+  ScopedTimer timer(buildTime);
+  torch::NoGradGuard no_grad;
+
+  torch::jit::Module trunk("ConvTrunk");
+  for (size_t i = 0; i < params.size(); i++) {
+    trunk.register_parameter(TRUNK_PARAM_NAMES[i],
+                             params[i].detach().clone(), false);
+  }
+  trunk.define(TRUNK_SOURCE);
+  trunk.eval();
+
+  // optimize_for_inferenceは左辺値を受け取るので、freezeしたものを変数に置く
+  auto frozenTrunk = torch::jit::freeze(trunk);
+  auto frozen = std::make_shared<torch::jit::Module>(
+      torch::jit::optimize_for_inference(frozenTrunk));
+
+  // プロファイリング実行をここで済ませておく
+  auto x = torch::zeros({1, params[0].size(1), 84, 84});
+  for (int i = 0; i < 3; i++) {
+    forward(*frozen, x);
+  }
+  return frozen;
+}
+
+torch::Tensor PackedConvTrunk::forward(torch::jit::Module &module,
+                                       const torch::Tensor x) {
+  return module.forward({x}).toTensor();
+}
+
+std::shared_ptr<torch::jit::Module>
+PackedConvTrunk::get(const std::vector<torch::Tensor> &params) {
+  auto current = stamp(params);
+  std::lock_guard<std::mutex> lock(mtx);
+  if (!module || current.size() != stamps.size()) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < current.size(); i++) {
+    if (current[i].data != stamps[i].data ||
+        current[i].version != stamps[i].version) {
+      return nullptr;
+    }
+  }
+  return module;
+}
+
+std::vector<PackedConvTrunk::Stamp>
+PackedConvTrunk::stamp(const std::vector<torch::Tensor> &params) {
+  std::vector<Stamp> stamps;
+  for (auto &p : params) {
+    stamps.push_back({p.data_ptr(), p._version()});
+  }
+  return stamps;
+}
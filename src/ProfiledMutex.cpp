@@ -0,0 +1,109 @@
+#include "ProfiledMutex.hpp"
+#include "Common.hpp"
+#include "ThreadPlacement.hpp"
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+std::atomic<bool> gLockProfiling{false};
+
+namespace {
+
+std::atomic<bool> gDumpRequested{false};
+
+// 統計の一覧。ミューテックスはグローバル変数からも作られるので、最初に使うときに作る
+struct LockRegistry {
+  std::mutex mtx;
+  std::map<std::string, std::unique_ptr<LockStats>> stats;
+};
+
+LockRegistry &registry() {
+  static LockRegistry instance;
+  return instance;
+}
+
+void onSignal(int) { gDumpRequested = true; }
+
+} // namespace
+
+LockStats &lockStats(const std::string &name) {
+  auto &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mtx);
+  auto &stats = reg.stats[name];
+  if (!stats) {
+    auto prefix = "lock/" + name;
+    stats.reset(new LockStats{metrics().counter(prefix + "/acquisitions"),
+                              metrics().counter(prefix + "/contended"),
+                              metrics().counter(prefix + "/wait_ns"),
+                              metrics().counter(prefix + "/hold_ns")});
+  }
+  return *stats;
+}
+
+void dumpLockStats() {
+  struct Row {
+    std::string name;
+    int64_t acquisitions, contended, waitNanos, holdNanos;
+  };
+  std::vector<Row> rows;
+  {
+    auto &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mtx);
+    for (auto &[name, stats] : reg.stats) {
+      rows.push_back({name, stats->acquisitions.value(),
+                      stats->contended.value(), stats->waitNanos.value(),
+                      stats->holdNanos.value()});
+    }
+  }
+  std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+    return a.waitNanos > b.waitNanos;
+  });
+
+  printf("lock profile (sorted by wait time)\n");
+  printf("%-32s %12s %12s %9s %12s %12s %12s\n", "name", "acquisitions",
+         "contended", "contend%", "wait_ms", "avg_wait_us", "hold_ms");
+  for (auto &row : rows) {
+    printf("%-32s %12ld %12ld %8.2f%% %12.1f %12.2f %12.1f\n",
+           row.name.c_str(), row.acquisitions, row.contended,
+           row.acquisitions ? 100.0 * row.contended / row.acquisitions : 0.0,
+           row.waitNanos / 1e6,
+           row.contended ? row.waitNanos / 1e3 / row.contended : 0.0,
+           row.holdNanos / 1e6);
+  }
+  fflush(stdout);
+}
+
+void startLockProfiler() {
+  auto *env = getenv("LOCK_PROFILE");
+  if (LOCK_PROFILE_ENABLED || (env && atoi(env) != 0)) {
+    gLockProfiling = true;
+  }
+  signal(SIGUSR2, onSignal);
+  std::thread([] {
+    placeCurrentThread(ThreadRole::Background);
+    setTraceThreadName("lock_profiler");
+    auto lastDump = std::chrono::steady_clock::now();
+    while (1) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      auto now = std::chrono::steady_clock::now();
+      if (gDumpRequested.exchange(false)) {
+        if (!gLockProfiling) {
+          gLockProfiling = true;
+          printf("lock profile: started\n");
+        }
+        dumpLockStats();
+        lastDump = now;
+      } else if (gLockProfiling && LOCK_PROFILE_DUMP_INTERVAL_SEC > 0 &&
+                 now - lastDump >=
+                     std::chrono::seconds(LOCK_PROFILE_DUMP_INTERVAL_SEC)) {
+        dumpLockStats();
+        lastDump = now;
+      }
+    }
+  }).detach();
+}
@@ -0,0 +1,203 @@
+#include "ReplayClient.hpp"
+#include "Metrics.hpp"
+#include "Utils.hpp"
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <thread>
+#include <unistd.h>
+
+ReplayClient::ReplayClient(const std::string &address) {
+  auto colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    host = address;
+    port = std::to_string(REPLAY_SERVER_PORT);
+  } else {
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+  }
+  std::cout << "use replay server " << host << ":" << port << std::endl;
+}
+
+ReplayClient::~ReplayClient() {
+  for (auto fd : idleFds) {
+    close(fd);
+  }
+}
+
+int ReplayClient::connectServer() {
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  auto ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+  if (ret != 0) {
+    printf("failed to getaddrinfo(%s)\n", gai_strerror(ret));
+    return -1;
+  }
+
+  int fd = -1;
+  for (auto *ai = res; ai != nullptr; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd == -1) {
+    printf("failed to connect replay server(errno:%d, error_str:%s)\n", errno,
+           strerror(errno));
+    return -1;
+  }
+
+  // 小さいメッセージ（優先度の更新、サンプルの要求）を待たせない
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+int ReplayClient::acquire() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!idleFds.empty()) {
+      auto fd = idleFds.back();
+      idleFds.pop_back();
+      return fd;
+    }
+  }
+  return connectServer();
+}
+
+void ReplayClient::release(int fd, bool ok) {
+  if (!ok) {
+    close(fd);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  idleFds.push_back(fd);
+}
+
+void ReplayClient::insert(const torch::Tensor &priorities,
+                          const std::vector<StoredData> &dataList) {
+  static auto &insertBytes = metrics().counter("replay/remote/insert_bytes");
+  static auto &insertDrops = metrics().counter("replay/remote/insert_drops");
+
+  auto count = dataList.size();
+  auto prios = priorities.to(torch::kCPU, torch::kFloat).contiguous();
+  auto *prioPtr = prios.data_ptr<float>();
+
+  ReplayMessageHeader header = {REPLAY_OP_INSERT, (uint32_t)count};
+  std::vector<InsertItem> items(count);
+  for (size_t i = 0; i < count; i++) {
+    items[i] = {prioPtr[i], dataList[i].reward, dataList[i].size};
+  }
+
+  // ヘッダー、項目、ブロブの順。ブロブはアリーナ上の領域を直接渡す
+  std::vector<struct iovec> iov;
+  iov.reserve(2 + count);
+  iov.push_back({&header, sizeof(header)});
+  iov.push_back({items.data(), count * sizeof(InsertItem)});
+  int64_t bytes = 0;
+  for (auto &data : dataList) {
+    iov.push_back({data.ptr.get(), (size_t)data.size});
+    bytes += data.size;
+  }
+
+  auto fd = acquire();
+  if (fd == -1) {
+    insertDrops.add(count);
+    return;
+  }
+  auto ok = sendAllv(fd, iov);
+  release(fd, ok);
+  if (ok) {
+    insertBytes.add(bytes);
+  } else {
+    insertDrops.add(count);
+  }
+}
+
+bool ReplayClient::trySample(int fd, SampleData &sampleData) {
+  thread_local std::vector<char> blob;
+
+  ReplayMessageHeader header = {REPLAY_OP_SAMPLE, BATCH_SIZE};
+  std::vector<struct iovec> iov = {{&header, sizeof(header)}};
+  if (!sendAllv(fd, iov)) {
+    return false;
+  }
+
+  if (!recvAll(fd, &header, sizeof(header)) || header.op != REPLAY_OP_SAMPLE ||
+      header.count != BATCH_SIZE) {
+    return false;
+  }
+  std::array<SampleItem, BATCH_SIZE> items;
+  if (!recvAll(fd, items.data(), sizeof(items))) {
+    return false;
+  }
+
+  // 受信用のバッファから直接展開する
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    blob.resize(items[i].size);
+    if (!recvAll(fd, blob.data(), blob.size()) ||
+        !decompress(blob.data(), blob.size(), sampleData.dataList[i])) {
+      return false;
+    }
+    sampleData.indexList[i] = items[i].index;
+    sampleData.labelList[i] = items[i].label;
+  }
+  return true;
+}
+
+void ReplayClient::sample(SampleData &sampleData) {
+  static auto &sampleErrors = metrics().counter("replay/remote/sample_errors");
+
+  while (1) {
+    auto fd = acquire();
+    if (fd != -1) {
+      auto ok = trySample(fd, sampleData);
+      release(fd, ok);
+      if (ok) {
+        return;
+      }
+    }
+    sampleErrors.add();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+}
+
+void ReplayClient::updatePriorities(std::array<int, BATCH_SIZE> &labels,
+                                    std::array<int, BATCH_SIZE> &indexes,
+                                    torch::Tensor &priorities) {
+  static auto &updateDrops = metrics().counter("replay/remote/update_drops");
+
+  auto prios = priorities.to(torch::kCPU, torch::kFloat).contiguous();
+  auto *prioPtr = prios.data_ptr<float>();
+
+  ReplayMessageHeader header = {REPLAY_OP_UPDATE_PRIORITIES, BATCH_SIZE};
+  std::array<PriorityItem, BATCH_SIZE> items;
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    items[i] = {indexes[i], labels[i], prioPtr[i]};
+  }
+  std::vector<struct iovec> iov = {{&header, sizeof(header)},
+                                   {items.data(), sizeof(items)}};
+
+  auto fd = acquire();
+  if (fd == -1) {
+    updateDrops.add(BATCH_SIZE);
+    return;
+  }
+  auto ok = sendAllv(fd, iov);
+  release(fd, ok);
+  if (!ok) {
+    updateDrops.add(BATCH_SIZE);
+  }
+}
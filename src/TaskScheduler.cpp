@@ -0,0 +1,155 @@
+#include "TaskScheduler.hpp"
+#include "Common.hpp"
+#include "Metrics.hpp"
+#include "ThreadPlacement.hpp"
+#include "Tracer.hpp"
+#include <chrono>
+#include <string>
+
+namespace {
+
+// ワーカーのスレッドなら、そのワーカーの番号
+thread_local int tWorkerIndex = -1;
+
+} // namespace
+
+TaskScheduler::TaskScheduler(int numThreads) {
+  for (int i = 0; i < numThreads; i++) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+  for (int i = 0; i < numThreads; i++) {
+    threads.emplace_back(&TaskScheduler::workerLoop, this, i);
+  }
+}
+
+TaskScheduler::~TaskScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMtx);
+    stopping = true;
+  }
+  sleepCv.notify_all();
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+void TaskScheduler::submit(TaskPriority priority, Task task) {
+  static auto &pendingGauge = metrics().gauge("scheduler/pending");
+
+  auto index = tWorkerIndex >= 0
+                   ? tWorkerIndex
+                   : nextWorker.fetch_add(1, std::memory_order_relaxed) %
+                         (int)workers.size();
+  {
+    auto &worker = *workers[index];
+    std::lock_guard<std::mutex> lock(worker.mtx);
+    worker.queues[(int)priority].push_back(std::move(task));
+  }
+  pendingGauge.set(pending.fetch_add(1) + 1);
+
+  // 寝ようとしているワーカーが起こし損ねないように、ロックを通してから起こす
+  { std::lock_guard<std::mutex> lock(sleepMtx); }
+  sleepCv.notify_one();
+}
+
+bool TaskScheduler::pop(int self, TaskPriority lowest, Task &task) {
+  static auto &steals = metrics().counter("scheduler/steals");
+  auto numWorkers = (int)workers.size();
+
+  for (int p = 0; p <= (int)lowest; p++) {
+    for (int k = 0; k < numWorkers; k++) {
+      auto index = ((self < 0 ? 0 : self) + k) % numWorkers;
+      auto &worker = *workers[index];
+      std::lock_guard<std::mutex> lock(worker.mtx);
+      auto &queue = worker.queues[p];
+      if (queue.empty()) {
+        continue;
+      }
+      if (index == self) {
+        task = std::move(queue.back());
+        queue.pop_back();
+      } else {
+        task = std::move(queue.front());
+        queue.pop_front();
+        steals.add();
+      }
+      pending.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TaskScheduler::runOne(TaskPriority lowest) {
+  static auto &executed = metrics().counter("scheduler/tasks");
+  Task task;
+  if (!pop(tWorkerIndex, lowest, task)) {
+    return false;
+  }
+  task();
+  executed.add();
+  return true;
+}
+
+void TaskScheduler::workerLoop(int index) {
+  tWorkerIndex = index;
+  placeCurrentThread(ThreadRole::Worker);
+  setTraceThreadName("worker " + std::to_string(index));
+
+  while (!stopping) {
+    if (runOne(TaskPriority::Low)) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleepMtx);
+    sleepCv.wait(lock, [&] { return stopping || pending > 0; });
+  }
+}
+
+TaskScheduler &scheduler() {
+  static TaskScheduler instance(TASK_SCHEDULER_THREADS);
+  return instance;
+}
+
+void TaskGroup::run(TaskPriority priority, Task task) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    count++;
+  }
+  scheduler().submit(priority, [this, task = std::move(task)] {
+    task();
+    // waitはこのロックを取ってから戻るので、解放した後はthisに触れない
+    std::lock_guard<std::mutex> lock(mtx);
+    if (--count == 0) {
+      cv.notify_all();
+    }
+  });
+}
+
+void TaskGroup::wait() {
+  while (1) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (count == 0) {
+        return;
+      }
+    }
+    if (!scheduler().runOne(TaskPriority::High)) {
+      // 残りは他のワーカーが実行中
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait_for(lock, std::chrono::microseconds(100),
+                  [&] { return count == 0; });
+    }
+  }
+}
+
+void parallelFor(int n, TaskPriority priority,
+                 const std::function<void(int)> &fn) {
+  TaskGroup group;
+  for (int i = 1; i < n; i++) {
+    group.run(priority, [&fn, i] { fn(i); });
+  }
+  if (n > 0) {
+    fn(0);
+  }
+  group.wait();
+}
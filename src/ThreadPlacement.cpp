@@ -0,0 +1,236 @@
+#include "ThreadPlacement.hpp"
+#include "Common.hpp"
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <map>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct CoreSet {
+  std::vector<int> cpus;
+  int node = 0;
+};
+
+struct Plan {
+  CoreSet inference;
+  CoreSet replay;
+  std::vector<CoreSet> train;
+};
+
+// "0-3,8-11"の形式
+std::vector<int> parseCpuList(const std::string &list) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    auto end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    auto range = list.substr(pos, end - pos);
+    auto dash = range.find('-');
+    if (!range.empty() && isdigit(range[0])) {
+      auto first = std::stoi(range);
+      auto last = dash == std::string::npos ? first
+                                            : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+// NUMAノードごとの、このプロセスが使えるCPU
+std::map<int, std::vector<int>> readTopology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  std::map<int, std::vector<int>> nodes;
+  std::string online;
+  std::ifstream("/sys/devices/system/node/online") >> online;
+  for (auto node : parseCpuList(online)) {
+    std::string list;
+    std::ifstream("/sys/devices/system/node/node" + std::to_string(node) +
+                  "/cpulist") >>
+        list;
+    for (auto cpu : parseCpuList(list)) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        nodes[node].push_back(cpu);
+      }
+    }
+  }
+
+  // sysfsが読めなければ一つのノードとみなす
+  if (nodes.empty()) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        nodes[0].push_back(cpu);
+      }
+    }
+  }
+  return nodes;
+}
+
+// 学習スレッドはノードを連続したブロックで分け、それぞれのノードのコアを取る
+// リプレイはノード0の末尾のコア、残りは推論に回す
+Plan makePlan() {
+  auto nodes = readTopology();
+  std::vector<int> nodeIds;
+  int totalCpus = 0;
+  for (auto &[node, cpus] : nodes) {
+    nodeIds.push_back(node);
+    totalCpus += cpus.size();
+  }
+
+  Plan plan;
+  plan.replay.node = nodeIds[0];
+  auto &firstCpus = nodes[nodeIds[0]];
+  for (int i = 0; i < PLACEMENT_REPLAY_CORES && firstCpus.size() > 1; i++) {
+    plan.replay.cpus.push_back(firstCpus.back());
+    firstCpus.pop_back();
+  }
+
+  auto coresPerTrain =
+      std::max(1, (int)(totalCpus * PLACEMENT_TRAIN_CORE_RATIO) /
+                      NUM_TRAIN_THREADS);
+  for (int i = 0; i < NUM_TRAIN_THREADS; i++) {
+    CoreSet set;
+    set.node = nodeIds[i * nodeIds.size() / NUM_TRAIN_THREADS];
+    auto &cpus = nodes[set.node];
+    while ((int)set.cpus.size() < coresPerTrain && cpus.size() > 1) {
+      set.cpus.push_back(cpus.front());
+      cpus.erase(cpus.begin());
+    }
+    // ノードのコアが足りなければ、残っているところから取る
+    for (auto &[node, other] : nodes) {
+      while ((int)set.cpus.size() < coresPerTrain && other.size() > 1) {
+        set.cpus.push_back(other.front());
+        other.erase(other.begin());
+      }
+    }
+    plan.train.push_back(set);
+  }
+
+  for (auto &[node, cpus] : nodes) {
+    plan.inference.cpus.insert(plan.inference.cpus.end(), cpus.begin(),
+                               cpus.end());
+  }
+  plan.inference.node = nodeIds[0];
+
+  // コアが少なすぎて空になった役割は推論と共有する
+  if (plan.replay.cpus.empty()) {
+    plan.replay = plan.inference;
+  }
+  for (auto &set : plan.train) {
+    if (set.cpus.empty()) {
+      set = plan.inference;
+    }
+  }
+  return plan;
+}
+
+const Plan &plan() {
+  static Plan instance = makePlan();
+  return instance;
+}
+
+const CoreSet &roleCores(ThreadRole role, int index) {
+  switch (role) {
+  case ThreadRole::Train:
+    // NUM_TRAIN_THREADSを超えて増やした学習スレッドは推論のコアを借りる
+    return index < (int)plan().train.size() ? plan().train[index]
+                                            : plan().inference;
+  case ThreadRole::Replay:
+  case ThreadRole::Background:
+    return plan().replay;
+  default:
+    return plan().inference;
+  }
+}
+
+std::string toString(const std::vector<int> &cpus) {
+  std::string str;
+  for (auto cpu : cpus) {
+    str += (str.empty() ? "" : ",") + std::to_string(cpu);
+  }
+  return str;
+}
+
+} // namespace
+
+void initThreadPlacement() {
+  if (!THREAD_PLACEMENT_ENABLED) {
+    return;
+  }
+  // 最初の並列処理より前でないと設定できない
+  at::set_num_interop_threads(PLACEMENT_INTEROP_THREADS);
+
+  auto &p = plan();
+  printf("thread placement: inference [%s] node %d, replay [%s] node %d\n",
+         toString(p.inference.cpus).c_str(), p.inference.node,
+         toString(p.replay.cpus).c_str(), p.replay.node);
+  for (size_t i = 0; i < p.train.size(); i++) {
+    printf("thread placement: train %zu [%s] node %d\n", i,
+           toString(p.train[i].cpus).c_str(), p.train[i].node);
+  }
+}
+
+void placeCurrentThread(ThreadRole role, int index) {
+  if (!THREAD_PLACEMENT_ENABLED) {
+    return;
+  }
+  auto &cores = roleCores(role, index);
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cores.cpus) {
+    CPU_SET(cpu, &set);
+  }
+  auto ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0) {
+    printf("failed to pthread_setaffinity_np(error_str:%s)\n", strerror(ret));
+  }
+
+  // intra-opのプールはこのスレッドのアフィニティを引き継ぐ
+  // 遅延初期化で上書きされないように、先に初期化しておく
+  at::internal::lazy_init_num_threads();
+  if (role == ThreadRole::Train && index < NUM_TRAIN_THREADS) {
+    at::set_num_threads(cores.cpus.size());
+  } else if (role == ThreadRole::Inference) {
+    at::set_num_threads(PLACEMENT_INFERENCE_INTRA_OP_THREADS);
+  } else {
+    at::set_num_threads(1);
+  }
+}
+
+int roleNode(ThreadRole role, int index) {
+  if (!THREAD_PLACEMENT_ENABLED) {
+    return 0;
+  }
+  return roleCores(role, index).node;
+}
+
+void bindMemoryToNode(void *addr, size_t size, int node) {
+  if (!THREAD_PLACEMENT_ENABLED) {
+    return;
+  }
+  unsigned long mask = 1UL << node;
+  if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &mask,
+              sizeof(mask) * 8, 0) == -1) {
+    printf("failed to mbind(errno:%d, error_str:%s)\n", errno,
+           strerror(errno));
+  }
+}
@@ -0,0 +1,183 @@
+#include "Tracer.hpp"
+#include "Common.hpp"
+#include "Metrics.hpp"
+#include "ThreadPlacement.hpp"
+#include <ATen/record_function.h>
+#include <csignal>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+std::atomic<bool> gTracing{false};
+
+namespace {
+
+struct TraceEvent {
+  const char *name;
+  int64_t start;
+  int64_t end;
+};
+
+// 書き込むのは持ち主のスレッドだけ
+// 書き出し側はgenerationが今回の記録のもので、count未満の分だけを読む
+struct ThreadBuffer {
+  std::unique_ptr<TraceEvent[]> events{new TraceEvent[TRACE_BUFFER_EVENTS]};
+  std::atomic<int> count{0};
+  std::atomic<int> generation{-1};
+  int tid;
+  std::string name;
+};
+
+// スレッドが終わってもバッファは残し、最後の記録を書き出せるようにする
+std::mutex gBuffersMtx;
+std::vector<std::unique_ptr<ThreadBuffer>> gBuffers;
+// 記録を始めるたびに増やす
+std::atomic<int> gGeneration{0};
+std::atomic<bool> gTraceRequested{false};
+
+thread_local ThreadBuffer *tBuffer = nullptr;
+thread_local std::string tThreadName;
+
+ThreadBuffer *threadBuffer() {
+  if (tBuffer == nullptr) {
+    auto buffer = std::make_unique<ThreadBuffer>();
+    buffer->tid = syscall(SYS_gettid);
+    buffer->name = tThreadName.empty()
+                       ? "thread " + std::to_string(buffer->tid)
+                       : tThreadName;
+    tBuffer = buffer.get();
+    std::lock_guard<std::mutex> lock(gBuffersMtx);
+    gBuffers.push_back(std::move(buffer));
+  }
+  return tBuffer;
+}
+
+// libtorchの演算の開始時刻
+struct OpContext : at::ObserverContext {
+  explicit OpContext(int64_t start_) : start(start_) {}
+  int64_t start;
+};
+
+std::unique_ptr<at::ObserverContext> onOpStart(const at::RecordFunction &fn) {
+  return std::make_unique<OpContext>(traceNowNanos());
+}
+
+void onOpEnd(const at::RecordFunction &fn, at::ObserverContext *ctx) {
+  if (ctx != nullptr && gTracing.load(std::memory_order_acquire)) {
+    recordSpan(fn.name(), static_cast<OpContext *>(ctx)->start,
+               traceNowNanos());
+  }
+}
+
+void onSignal(int) { gTraceRequested = true; }
+
+void writeTrace(const std::string &path, int generation, int64_t origin) {
+  auto *fp = fopen(path.c_str(), "w");
+  if (fp == nullptr) {
+    printf("failed to open %s\n", path.c_str());
+    return;
+  }
+
+  int64_t numEvents = 0;
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  auto first = true;
+  std::lock_guard<std::mutex> lock(gBuffersMtx);
+  for (auto &buffer : gBuffers) {
+    if (buffer->generation.load(std::memory_order_acquire) != generation) {
+      continue;
+    }
+    auto count = buffer->count.load(std::memory_order_acquire);
+    fprintf(fp,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", buffer->tid, buffer->name.c_str());
+    first = false;
+    for (int i = 0; i < count; i++) {
+      auto &event = buffer->events[i];
+      fprintf(fp,
+              ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f}",
+              event.name, buffer->tid, (event.start - origin) / 1e3,
+              (event.end - event.start) / 1e3);
+    }
+    numEvents += count;
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+  printf("trace: wrote %ld events to %s\n", numEvents, path.c_str());
+}
+
+// 記録を一回分行い、書き出す
+void traceWindow(const std::string &dir) {
+  auto generation = gGeneration.fetch_add(1) + 1;
+  auto origin = traceNowNanos();
+
+  at::CallbackHandle handle = 0;
+  if (TRACE_TORCH_OPS) {
+    handle = at::addGlobalCallback(
+        at::RecordFunctionCallback(onOpStart, onOpEnd)
+            .scopes({at::RecordScope::FUNCTION}));
+  }
+  gTracing.store(true, std::memory_order_release);
+  printf("trace: recording for %d sec\n", TRACE_WINDOW_SEC);
+
+  std::this_thread::sleep_for(std::chrono::seconds(TRACE_WINDOW_SEC));
+
+  gTracing.store(false, std::memory_order_release);
+  if (TRACE_TORCH_OPS) {
+    at::removeCallback(handle);
+  }
+
+  std::filesystem::create_directories(dir);
+  writeTrace(dir + "/trace-" + std::to_string(time(nullptr)) + ".json",
+             generation, origin);
+}
+
+} // namespace
+
+void recordSpan(const char *name, int64_t start, int64_t end) {
+  static auto &dropped = metrics().counter("trace/dropped_events");
+  auto *buffer = threadBuffer();
+
+  // 新しい記録の最初のスパンで、前回の分を捨てる
+  auto generation = gGeneration.load(std::memory_order_acquire);
+  int count;
+  if (buffer->generation.load(std::memory_order_relaxed) != generation) {
+    buffer->count.store(0, std::memory_order_relaxed);
+    buffer->generation.store(generation, std::memory_order_release);
+    count = 0;
+  } else {
+    count = buffer->count.load(std::memory_order_relaxed);
+  }
+
+  if (count >= TRACE_BUFFER_EVENTS) {
+    dropped.add();
+    return;
+  }
+  buffer->events[count] = {name, start, end};
+  buffer->count.store(count + 1, std::memory_order_release);
+}
+
+void setTraceThreadName(const std::string &name) { tThreadName = name; }
+
+void requestTrace() { gTraceRequested = true; }
+
+void startTracer(const std::string &dir) {
+  signal(SIGUSR1, onSignal);
+  std::thread([dir] {
+    placeCurrentThread(ThreadRole::Background);
+    setTraceThreadName("tracer");
+    while (1) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      if (gTraceRequested.exchange(false)) {
+        traceWindow(dir);
+      }
+    }
+  }).detach();
+}
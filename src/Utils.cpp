@@ -1,5 +1,11 @@
+#include "Metrics.hpp"
 #include "Models.hpp"
+#include "TaskScheduler.hpp"
+#include "Tracer.hpp"
+#include <algorithm>
+#include <cstddef>
 #include <future>
+#include <numeric>
 #include <zstd.h> // presumes zstd library is installed
 
 using namespace torch::indexing;
@@ -45,7 +51,8 @@ std::tuple<float, torch::Tensor>
 retraceLoss(const torch::Tensor action, const torch::Tensor reward,
             const torch::Tensor done, const torch::Tensor policy,
             const torch::Tensor onlineQ, const torch::Tensor targetQ,
-            const torch::Device device, bool backward) {
+            const torch::Device device, bool backward,
+            const torch::Tensor length) {
   auto batchSize = action.size(0);
   auto retraceLength = action.size(1) - 1;
 
@@ -83,6 +90,16 @@ retraceLoss(const torch::Tensor action, const torch::Tensor reward,
   //           << std::endl;
   auto td = reward.index({Slice(), Slice(None, -1)}) + nextTargetQValue -
             currentTargetQValue;
+
+  // エピソード終了後のゼロ埋め部分は、次のステップも有効なところまでを使う
+  // batch, seq
+  torch::Tensor validMask;
+  if (length.defined()) {
+    validMask = (torch::arange(1, retraceLength + 1).unsqueeze(0) <
+                 length.unsqueeze(1))
+                    .to(td.device(), td.scalar_type());
+    td = td * validMask;
+  }
   // std::cout << "td: " << td.sizes() << std::endl;
 
   // retrace coefficients
@@ -121,11 +138,18 @@ retraceLoss(const torch::Tensor action, const torch::Tensor reward,
 
   // batch, seq
   auto absErrors = torch::abs(qValue.squeeze(2) - retraceOperator);
+  if (validMask.defined()) {
+    absErrors = absErrors * validMask;
+  }
   // std::cout << "absErrors: " << absErrors.sizes() << std::endl;
 
   // batch <- batch, seq
+  auto meanErrors =
+      validMask.defined()
+          ? torch::sum(absErrors, 1) / torch::clamp_min(validMask.sum(1), 1)
+          : torch::mean(absErrors, 1);
   auto priorities =
-      (ETA * torch::amax(absErrors, 1) + (1 - ETA) * torch::mean(absErrors, 1));
+      (ETA * torch::amax(absErrors, 1) + (1 - ETA) * meanErrors);
   // std::cout << "priorities: " << priorities.sizes() << std::endl;
 
   // batch <- batch, seq
@@ -135,6 +159,10 @@ retraceLoss(const torch::Tensor action, const torch::Tensor reward,
   auto loss = torch::mean(losses);
 
   if (backward) {
+    static auto &backwardTime = metrics().histogram("train/backward_us");
+    ScopedTimer timer(backwardTime);
+    TraceSpan span("train/backward");
+
     // Compute gradients of the loss w.r.t. the parameters of our model.
     loss.backward();
   }
@@ -142,25 +170,134 @@ retraceLoss(const torch::Tensor action, const torch::Tensor reward,
   return {loss.item<float>(), priorities.detach().clone()};
 }
 
-StoredData compress(ReplayData &replayData) {
-  char tmp[sizeof(ReplayData)];
+// 圧縮率の計測
+void recordCompression(size_t compressedSize) {
+  static auto &rawBytes = metrics().counter("replay/raw_bytes");
+  static auto &compressedBytes = metrics().counter("replay/compressed_bytes");
+  static auto &ratio = metrics().gauge("replay/compression_ratio");
+
+  rawBytes.add(sizeof(ReplayData));
+  compressedBytes.add(compressedSize);
+  ratio.set((double)rawBytes.value() / compressedBytes.value());
+}
+
+// 圧縮コンテキストはスレッドごとに使い回す
+ZSTD_CCtx *threadCCtx() {
+  thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(
+      ZSTD_createCCtx(), &ZSTD_freeCCtx);
+  return cctx.get();
+}
 
+// アリーナに空きがあれば、そこへ直接圧縮する
+// 無ければスレッドごとの作業領域に圧縮してから、ちょうどのサイズでヒープに置く
+template <typename F>
+StoredData compressWith(BlobArena::Writer *writer, F compressTo) {
   size_t const maxCompressedSize = ZSTD_compressBound(sizeof(ReplayData));
-  size_t const compressedSize =
-      ZSTD_compress(tmp, maxCompressedSize, &replayData, sizeof(ReplayData),
-                    ZSTD_CLEVEL_DEFAULT);
+
+  char *dst = writer ? writer->reserve(maxCompressedSize) : nullptr;
+  if (dst) {
+    size_t const compressedSize = compressTo(dst, maxCompressedSize);
+    auto code = ZSTD_isError(compressedSize);
+    if (code) {
+      exit(code);
+    }
+    writer->commit(compressedSize);
+    recordCompression(compressedSize);
+
+    StoredData data;
+    data.size = compressedSize;
+    data.ptr = BlobPtr(dst, BlobDeleter{writer->getArena()});
+    return std::move(data);
+  }
+
+  thread_local std::unique_ptr<char[]> tmp(new char[maxCompressedSize]);
+  size_t const compressedSize = compressTo(tmp.get(), maxCompressedSize);
   auto code = ZSTD_isError(compressedSize);
   if (code) {
     exit(code);
   }
 
+  recordCompression(compressedSize);
+
   StoredData data;
   data.size = compressedSize;
-  data.ptr = std::unique_ptr<char[]>(new char[compressedSize]);
-  memcpy(data.ptr.get(), tmp, compressedSize);
+  data.ptr = BlobPtr(new char[compressedSize]);
+  memcpy(data.ptr.get(), tmp.get(), compressedSize);
   return std::move(data);
 }
 
+StoredData compress(ReplayData &replayData, BlobArena::Writer *writer) {
+  return compressWith(writer, [&](char *dst, size_t capacity) {
+    return ZSTD_compressCCtx(threadCCtx(), dst, capacity, &replayData,
+                             sizeof(ReplayData), ZSTD_CLEVEL_DEFAULT);
+  });
+}
+
+// ReplayDataと同じバイト列をフィールドごとにストリーム圧縮する
+// フィールド間のパディングはゼロで埋める
+StoredData compress(const ReplayDataView &view, BlobArena::Writer *writer) {
+  return compressWith(writer, [&](char *dst, size_t capacity) -> size_t {
+    auto *cctx = threadCCtx();
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_CLEVEL_DEFAULT);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, sizeof(ReplayData));
+
+    ZSTD_outBuffer out = {dst, capacity, 0};
+    size_t written = 0;
+    size_t ret = 0;
+    static const char zeros[8] = {0};
+
+    auto feed = [&](const void *src, size_t size) {
+      ZSTD_inBuffer in = {src, size, 0};
+      while (in.pos < in.size && !ZSTD_isError(ret)) {
+        ret = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_continue);
+      }
+      written += size;
+    };
+    // 隙間の大きさはレイアウト次第なので、zerosの大きさずつ繰り返して埋める
+    auto pad = [&](size_t size) {
+      while (size > 0) {
+        auto n = std::min(size, sizeof(zeros));
+        feed(zeros, n);
+        size -= n;
+      }
+    };
+    auto field = [&](size_t offset, const void *src, size_t size) {
+      pad(offset - written);
+      feed(src, size);
+    };
+
+    for (int t = 0; t < SEQ_LENGTH; t++) {
+      field(offsetof(ReplayData, state) + t * STATE_SIZE, view.state[t],
+            STATE_SIZE);
+    }
+    field(offsetof(ReplayData, action), view.action, SEQ_LENGTH);
+    field(offsetof(ReplayData, reward), view.reward,
+          SEQ_LENGTH * sizeof(float));
+    field(offsetof(ReplayData, policy), view.policy,
+          SEQ_LENGTH * sizeof(float));
+    field(offsetof(ReplayData, hiddenStates), view.hiddenStates,
+          LSTM_STATE_SIZE * sizeof(float));
+    field(offsetof(ReplayData, cellStates), view.cellStates,
+          LSTM_STATE_SIZE * sizeof(float));
+    field(offsetof(ReplayData, done), view.done, SEQ_LENGTH * sizeof(bool));
+    field(offsetof(ReplayData, length), &view.length, sizeof(int));
+    pad(sizeof(ReplayData) - written);
+    if (ZSTD_isError(ret)) {
+      return ret;
+    }
+
+    ZSTD_inBuffer in = {nullptr, 0, 0};
+    do {
+      ret = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+    } while (ret != 0 && !ZSTD_isError(ret));
+    if (ZSTD_isError(ret)) {
+      return ret;
+    }
+    return out.pos;
+  });
+}
+
 void decompress(StoredData &compressed, ReplayData &replayData) {
   size_t const decompressedSize = ZSTD_decompress(
       &replayData, sizeof(ReplayData), compressed.ptr.get(), compressed.size);
@@ -170,33 +307,64 @@ void decompress(StoredData &compressed, ReplayData &replayData) {
   }
 }
 
+// ディスク上のログから読む場合は、読み出し中に上書きされる可能性があるので
+// 失敗しても終了せずに呼び出し元に返す
+bool decompress(const char *src, int size, ReplayData &replayData) {
+  size_t const decompressedSize =
+      ZSTD_decompress(&replayData, sizeof(ReplayData), src, size);
+  return !ZSTD_isError(decompressedSize) &&
+         decompressedSize == sizeof(ReplayData);
+}
+
 void toBatchedTrainData(TrainData &train,
                         std::array<ReplayData, BATCH_SIZE> &dataList) {
+  // 有効なステップ数の長い順に並べ、forwardで短い系列を先に外せるようにする
+  std::iota(train.order.begin(), train.order.end(), 0);
+  std::stable_sort(train.order.begin(), train.order.end(), [&](int a, int b) {
+    return dataList[a].length > dataList[b].length;
+  });
 
-  for (int i = 0; i < BATCH_SIZE; i++) {
-    train.state.index_put_({i}, torch::from_blob(dataList[i].state,
-                                                 train.state.index({i}).sizes(),
-                                                 torch::kUInt8) /
-                                    255.0);
+  auto *lengthPtr = train.length.data_ptr<int64_t>();
+  for (int row = 0; row < BATCH_SIZE; row++) {
+    lengthPtr[row] = dataList[train.order[row]].length;
+  }
+
+  // 行ごとに別のタスクで変換する。書き込む先は行ごとに重ならない
+  parallelFor(BATCH_SIZE, TaskPriority::High, [&](int row) {
+    auto i = train.order[row];
+    auto length = dataList[i].length;
+
+    // ゼロ埋めの画面は変換せずにゼロにする
+    auto state = train.state.index({row});
+    state.narrow(0, 0, length)
+        .copy_(torch::from_blob(dataList[i].state,
+                                state.narrow(0, 0, length).sizes(),
+                                torch::kUInt8) /
+               255.0);
+    state.narrow(0, length, SEQ_LENGTH - length).zero_();
     train.action.index_put_(
-        {i}, torch::from_blob(dataList[i].action,
-                              train.action.index({i}).sizes(), torch::kUInt8));
+        {row},
+        torch::from_blob(dataList[i].action, train.action.index({row}).sizes(),
+                         torch::kUInt8));
     train.reward.index_put_(
-        {i}, torch::from_blob(dataList[i].reward,
-                              train.reward.index({i}).sizes(), torch::kFloat));
-    train.done.index_put_({i}, torch::from_blob(dataList[i].done,
-                                                train.done.index({i}).sizes(),
-                                                torch::kBool));
+        {row},
+        torch::from_blob(dataList[i].reward, train.reward.index({row}).sizes(),
+                         torch::kFloat));
+    train.done.index_put_({row},
+                          torch::from_blob(dataList[i].done,
+                                           train.done.index({row}).sizes(),
+                                           torch::kBool));
     train.hiddenStates.index_put_(
-        {i},
-        torch::from_blob(dataList[i].hiddenStates,
-                         train.hiddenStates.index({i}).sizes(), torch::kFloat));
+        {row}, torch::from_blob(dataList[i].hiddenStates,
+                                train.hiddenStates.index({row}).sizes(),
+                                torch::kFloat));
     train.cellStates.index_put_(
-        {i},
-        torch::from_blob(dataList[i].cellStates,
-                         train.cellStates.index({i}).sizes(), torch::kFloat));
+        {row}, torch::from_blob(dataList[i].cellStates,
+                                train.cellStates.index({row}).sizes(),
+                                torch::kFloat));
     train.policy.index_put_(
-        {i}, torch::from_blob(dataList[i].policy,
-                              train.policy.index({i}).sizes(), torch::kFloat));
-  }
+        {row},
+        torch::from_blob(dataList[i].policy, train.policy.index({row}).sizes(),
+                         torch::kFloat));
+  });
 }
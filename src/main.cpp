@@ -0,0 +1,52 @@
+#include "CachingCpuAllocator.hpp"
+#include "Distributed.hpp"
+#include "Learner.hpp"
+#include "Metrics.hpp"
+#include "ProfiledMutex.hpp"
+#include "ThreadPlacement.hpp"
+#include "Tracer.hpp"
+
+int main(void) {
+  // テンソルを作る前に差し替える
+  installCachingCpuAllocator();
+
+  int ret_code = 0;
+  auto stateTensor =
+      torch::zeros({1, 84, 84}, torch::TensorOptions().dtype(torch::kUInt8));
+  int actionSize = 9;
+  int numEnvs = NUM_ENVS;
+
+  initThreadPlacement();
+  initDistributed();
+
+  // 同じホストで複数プロセスを動かしても書き出し先が重ならないようにする
+  std::string metricsDir = METRICS_DIR;
+  if (distributedWorldSize() > 1) {
+    metricsDir += "/rank" + std::to_string(distributedRank());
+  }
+  startMetricsReporter(metricsDir, METRICS_FLUSH_INTERVAL);
+  startTracer(metricsDir);
+  startLockProfiler();
+
+  Learner learner(stateTensor, actionSize, numEnvs, TRACE_LENGTH, REPLAY_PERIOD,
+                  REPLAY_BUFFER_SIZE);
+
+  // 記録したアクターの通信を流す。学習スレッドは止まらないので、流し終えたら終了する
+  auto replayDir = actorReplayDir();
+  if (!replayDir.empty()) {
+    learner.replayActorLog(replayDir, actorReplayFast());
+    metrics().flush(metricsDir);
+    fflush(stdout);
+    std::quick_exit(EXIT_SUCCESS);
+  }
+
+  // actorからのリクエスト受付
+  auto inferThread = std::thread(&Learner::listenActor, &learner);
+  if (REMOTE_ACTOR_ENABLED) {
+    std::thread(&Learner::listenRemoteActor, &learner).detach();
+  }
+
+  inferThread.join();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,326 @@
+// infer.sockに複数のアクターとして接続し、合成または記録済みの画面を送り続ける
+// 負荷生成ツール
+// --tcpを付けると、リモートのアクターとして学習側のTCPリスナーに接続する
+// 達成したsteps/secと、アクションが返るまでの時間の分布を表示する
+#include "FrameCodec.hpp"
+#include "Protocol.hpp"
+#include "SocketIo.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <getopt.h>
+#include <memory>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <vector>
+
+struct Options {
+  int connections = NUM_ENVS;
+  double duration = 60;
+  int episodeLength = 1000;
+  double doneRate = 0;
+  double stepRate = 0;
+  std::string framesFile;
+  std::string socketPath = inferSocketPath();
+  std::string tcpAddress;
+};
+
+std::atomic<int64_t> gSteps = 0;
+std::atomic<int64_t> gSentBytes = 0;
+std::atomic<bool> gStop = false;
+
+void usage(const char *name) {
+  printf("usage: %s [options]\n"
+         "  -c, --connections N     number of actor connections (default %d)\n"
+         "  -d, --duration SEC      run time in seconds (default 60)\n"
+         "  -e, --episode-length N  steps per episode (default 1000)\n"
+         "  -p, --done-rate P       probability of an early done per step\n"
+         "  -r, --step-rate HZ      steps per second per connection "
+         "(default unlimited)\n"
+         "  -f, --frames FILE       raw 84x84 uint8 frames to send instead "
+         "of synthetic ones\n"
+         "  -s, --socket PATH       socket path (default %s)\n"
+         "  -t, --tcp HOST[:PORT]   connect over TCP as a remote actor "
+         "(default port %d)\n",
+         name, NUM_ENVS, inferSocketPath().c_str(), REMOTE_ACTOR_PORT);
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+  static struct option longOptions[] = {
+      {"connections", required_argument, 0, 'c'},
+      {"duration", required_argument, 0, 'd'},
+      {"episode-length", required_argument, 0, 'e'},
+      {"done-rate", required_argument, 0, 'p'},
+      {"step-rate", required_argument, 0, 'r'},
+      {"frames", required_argument, 0, 'f'},
+      {"socket", required_argument, 0, 's'},
+      {"tcp", required_argument, 0, 't'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:d:e:p:r:f:s:t:h", longOptions,
+                            nullptr)) != -1) {
+    switch (opt) {
+    case 'c':
+      options.connections = atoi(optarg);
+      break;
+    case 'd':
+      options.duration = atof(optarg);
+      break;
+    case 'e':
+      options.episodeLength = atoi(optarg);
+      break;
+    case 'p':
+      options.doneRate = atof(optarg);
+      break;
+    case 'r':
+      options.stepRate = atof(optarg);
+      break;
+    case 'f':
+      options.framesFile = optarg;
+      break;
+    case 's':
+      options.socketPath = optarg;
+      break;
+    case 't':
+      options.tcpAddress = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// 記録済みの画面を読み込む。無ければ空
+std::vector<uint8_t> loadFrames(const std::string &path) {
+  std::vector<uint8_t> frames;
+  if (path.empty()) {
+    return frames;
+  }
+  std::ifstream file(path, std::ios::binary);
+  frames.assign(std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>());
+  frames.resize(frames.size() / STATE_SIZE * STATE_SIZE);
+  return frames;
+}
+
+// 背景が平坦で、小さな物体が動く画面
+void syntheticFrame(uint8_t *state, int step, int envId) {
+  const int objectSize = 6;
+  std::fill(state, state + STATE_SIZE, 87);
+  for (int obj = 0; obj < 4; obj++) {
+    auto x = (step * (obj + 1) + obj * 17 + envId) % (84 - objectSize);
+    auto y = 10 + obj * 18;
+    for (int dy = 0; dy < objectSize; dy++) {
+      std::fill(&state[(y + dy) * 84 + x],
+                &state[(y + dy) * 84 + x + objectSize], 160 + obj * 20);
+    }
+  }
+}
+
+int connectLocal(const std::string &path) {
+  auto fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+  struct sockaddr_un sun;
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_LOCAL;
+  strcpy(sun.sun_path, path.c_str());
+  if (connect(fd, (const struct sockaddr *)&sun, sizeof(sun)) == -1) {
+    printf("failed to connect(errno:%d, error_str:%s)\n", errno,
+           strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// host[:port]に接続する
+int connectTcp(const std::string &address) {
+  auto host = address;
+  auto port = std::to_string(REMOTE_ACTOR_PORT);
+  auto colon = address.rfind(':');
+  if (colon != std::string::npos && address.find(':') == colon) {
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+  }
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  auto ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+  if (ret != 0) {
+    printf("failed to getaddrinfo(%s)\n", gai_strerror(ret));
+    return -1;
+  }
+
+  int fd = -1;
+  for (auto *ai = res; ai != nullptr; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd == -1) {
+    printf("failed to connect(errno:%d, error_str:%s)\n", errno,
+           strerror(errno));
+    return -1;
+  }
+
+  // ステップごとの小さな送信を待たせない
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// 1接続分のアクター
+void actorLoop(int envId, const Options &options,
+               const std::vector<uint8_t> &frames,
+               std::vector<int64_t> &latencies) {
+  auto remote = !options.tcpAddress.empty();
+  auto fd = remote ? connectTcp(options.tcpAddress)
+                   : connectLocal(options.socketPath);
+  if (fd == -1) {
+    return;
+  }
+  std::unique_ptr<FrameEncoder> encoder;
+  if (remote) {
+    encoder = std::make_unique<FrameEncoder>(REMOTE_ACTOR_ZSTD_LEVEL);
+  }
+
+  if (!sendAll(fd, &envId, sizeof(envId))) {
+    close(fd);
+    return;
+  }
+
+  std::mt19937 engine(envId);
+  std::uniform_real_distribution<> dist(0.0, 1.0);
+  Request request;
+  request.envId = envId;
+  int action;
+  int episodeStep = 0;
+  int64_t frameIndex = envId;
+  auto numFrames = (int64_t)(frames.size() / STATE_SIZE);
+
+  auto interval = std::chrono::nanoseconds(
+      options.stepRate > 0 ? (int64_t)(1e9 / options.stepRate) : 0);
+  auto next = std::chrono::steady_clock::now();
+
+  while (!gStop) {
+    if (numFrames > 0) {
+      memcpy(request.state, &frames[(frameIndex++ % numFrames) * STATE_SIZE],
+             STATE_SIZE);
+    } else {
+      syntheticFrame(request.state, episodeStep, envId);
+    }
+    request.reward = dist(engine) < 0.02 ? 1 : 0;
+    episodeStep++;
+    request.done = episodeStep >= options.episodeLength ||
+                   dist(engine) < options.doneRate;
+    if (request.done) {
+      episodeStep = 0;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto sent = remote ? encoder->send(fd, request.state, request.reward,
+                                       request.done)
+                       : sendAll(fd, &request, sizeof(request));
+    if (!sent || !recvAll(fd, &action, sizeof(action))) {
+      printf("connection %d closed\n", envId);
+      break;
+    }
+    auto end = std::chrono::steady_clock::now();
+    latencies.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+    gSteps++;
+    gSentBytes += remote ? 0 : sizeof(request);
+
+    if (options.stepRate > 0) {
+      next += interval;
+      std::this_thread::sleep_until(next);
+    }
+  }
+  if (remote) {
+    gSentBytes += encoder->totalSentBytes();
+  }
+  close(fd);
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    return EXIT_FAILURE;
+  }
+  auto frames = loadFrames(options.framesFile);
+
+  std::vector<std::vector<int64_t>> latencies(options.connections);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < options.connections; i++) {
+    // 推論側はenvIdで探索率を決めるので、NUM_ENVS未満にしておく
+    threads.emplace_back(actorLoop, i % NUM_ENVS, std::cref(options),
+                         std::cref(frames), std::ref(latencies[i]));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int64_t prevSteps = 0;
+  while (1) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    auto steps = gSteps.load();
+    printf("%ld steps/sec\n", steps - prevSteps);
+    prevSteps = steps;
+    if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+            .count() >= options.duration) {
+      break;
+    }
+  }
+  gStop = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+  auto elapsed =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  std::vector<int64_t> all;
+  for (auto &l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  std::sort(all.begin(), all.end());
+
+  auto percentile = [&](double p) {
+    if (all.empty()) {
+      return 0.0;
+    }
+    return all[std::min(all.size() - 1, (size_t)(p * all.size()))] / 1e3;
+  };
+
+  printf("connections: %d, steps: %zu, elapsed: %.1f sec\n",
+         options.connections, all.size(), elapsed);
+  printf("throughput: %.1f steps/sec\n", all.size() / elapsed);
+  printf("action latency (us): p50 %.1f, p99 %.1f, p999 %.1f\n",
+         percentile(0.5), percentile(0.99), percentile(0.999));
+  if (!all.empty()) {
+    printf("sent: %.1f bytes/step (raw %zu bytes/step)\n",
+           (double)gSentBytes / all.size(), sizeof(Request));
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,252 @@
+// リプレイを学習プロセスから切り離して持つサーバー
+// 複数の学習・推論プロセスがTCPでつなぎ、INSERT/SAMPLE/UPDATE_PRIORITIESを送る
+// プロトコルはReplayProtocol.hppを参照
+#include "Metrics.hpp"
+#include "ProfiledMutex.hpp"
+#include "Replay.hpp"
+#include "ReplayProtocol.hpp"
+#include <cstdio>
+#include <cstring>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+struct Options {
+  int port = REPLAY_SERVER_PORT;
+  int capacity = REPLAY_BUFFER_SIZE;
+  int64_t budgetBytes = replayBudgetBytes();
+  std::string metricsDir = "logs/replay_server";
+};
+
+void usage(const char *name) {
+  printf("usage: %s [options]\n"
+         "  -p, --port PORT         listen port (default %d)\n"
+         "  -c, --capacity N        max replay items (default %d)\n"
+         "  -b, --budget BYTES      memory budget for compressed blobs\n"
+         "                          (default %lld, 0 for no limit)\n"
+         "  -m, --metrics-dir DIR   metrics output directory "
+         "(default logs/replay_server)\n",
+         name, REPLAY_SERVER_PORT, (int)REPLAY_BUFFER_SIZE,
+         (long long)replayBudgetBytes());
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+  static struct option longOptions[] = {
+      {"port", required_argument, 0, 'p'},
+      {"capacity", required_argument, 0, 'c'},
+      {"budget", required_argument, 0, 'b'},
+      {"metrics-dir", required_argument, 0, 'm'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "p:c:b:m:h", longOptions, nullptr)) !=
+         -1) {
+    switch (opt) {
+    case 'p':
+      options.port = atoi(optarg);
+      break;
+    case 'c':
+      options.capacity = atoi(optarg);
+      break;
+    case 'b':
+      options.budgetBytes = atoll(optarg);
+      break;
+    case 'm':
+      options.metricsDir = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// ブロブはアリーナに直接受信し、そのままリプレイに渡す
+bool handleInsert(int fd, uint32_t count, Replay &replay,
+                  BlobArena::Writer &writer) {
+  static auto &insertBytes = metrics().counter("replay/server/insert_bytes");
+
+  std::vector<InsertItem> items(count);
+  if (!recvAll(fd, items.data(), count * sizeof(InsertItem))) {
+    return false;
+  }
+
+  std::vector<StoredData> dataList(count);
+  std::vector<float> priorities(count);
+  for (uint32_t i = 0; i < count; i++) {
+    auto size = items[i].size;
+    if (size <= 0 || size > REPLAY_ARENA_CHUNK_SIZE) {
+      printf("invalid blob size %d\n", size);
+      return false;
+    }
+
+    auto &data = dataList[i];
+    auto *dst = writer.reserve(size);
+    if (dst != nullptr) {
+      if (!recvAll(fd, dst, size)) {
+        return false;
+      }
+      writer.commit(size);
+      data.ptr = BlobPtr(dst, BlobDeleter{writer.getArena()});
+    } else {
+      data.ptr = BlobPtr(new char[size]);
+      if (!recvAll(fd, data.ptr.get(), size)) {
+        return false;
+      }
+    }
+    data.size = size;
+    data.reward = items[i].reward;
+    priorities[i] = items[i].priority;
+    insertBytes.add(size);
+  }
+
+  replay.putReplayQueue(torch::from_blob(priorities.data(), {(long)count},
+                                         torch::kFloat)
+                            .clone(),
+                        std::move(dataList));
+  return true;
+}
+
+bool handleSample(int fd, uint32_t count, Replay &replay,
+                  SampleBlobs &samples) {
+  if (count != BATCH_SIZE) {
+    printf("unsupported sample size %u\n", count);
+    return false;
+  }
+
+  replay.sampleBlobs(samples);
+
+  ReplayMessageHeader header = {REPLAY_OP_SAMPLE, BATCH_SIZE};
+  std::array<SampleItem, BATCH_SIZE> items;
+  std::vector<struct iovec> iov;
+  iov.reserve(2 + BATCH_SIZE);
+  iov.push_back({&header, sizeof(header)});
+  iov.push_back({items.data(), sizeof(items)});
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    auto &blob = samples.blobList[i];
+    items[i] = {samples.indexList[i], samples.labelList[i],
+                (int32_t)blob.size()};
+    iov.push_back({blob.data(), blob.size()});
+  }
+  return sendAllv(fd, iov);
+}
+
+bool handleUpdatePriorities(int fd, uint32_t count, Replay &replay) {
+  std::vector<PriorityItem> items(count);
+  if (!recvAll(fd, items.data(), count * sizeof(PriorityItem))) {
+    return false;
+  }
+  for (auto &item : items) {
+    if (!replay.updatePriorityChecked(item.label, item.index, item.priority)) {
+      printf("invalid priority update label %d index %d priority %f\n",
+             item.label, item.index, item.priority);
+      return false;
+    }
+  }
+  return true;
+}
+
+void serveConnection(int fd, Replay &replay) {
+  BlobArena::Writer writer(replay.getArena());
+  auto samples = std::make_unique<SampleBlobs>();
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  while (1) {
+    ReplayMessageHeader header;
+    if (!recvAll(fd, &header, sizeof(header))) {
+      break;
+    }
+    if (header.count > REPLAY_MAX_ITEMS) {
+      printf("too many items %u\n", header.count);
+      break;
+    }
+
+    bool ok;
+    switch (header.op) {
+    case REPLAY_OP_INSERT:
+      ok = handleInsert(fd, header.count, replay, writer);
+      break;
+    case REPLAY_OP_SAMPLE:
+      ok = handleSample(fd, header.count, replay, *samples);
+      break;
+    case REPLAY_OP_UPDATE_PRIORITIES:
+      ok = handleUpdatePriorities(fd, header.count, replay);
+      break;
+    default:
+      printf("unknown op %u\n", header.op);
+      ok = false;
+      break;
+    }
+    if (!ok) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    return EXIT_FAILURE;
+  }
+
+  startMetricsReporter(options.metricsDir, METRICS_FLUSH_INTERVAL);
+  startLockProfiler();
+
+  Replay replay(options.capacity, "", options.budgetBytes);
+
+  auto fdAccept = socket(AF_INET6, SOCK_STREAM, 0);
+  if (fdAccept == -1) {
+    printf("failed to socket(errno:%d, error_str:%s)\n", errno,
+           strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // 再起動してすぐに同じポートで待ち受けられるようにする
+  int one = 1;
+  setsockopt(fdAccept, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  // IPv4からの接続も受け付ける
+  int zero = 0;
+  setsockopt(fdAccept, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(options.port);
+
+  if (bind(fdAccept, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    printf("failed to bind(errno:%d, error_str:%s)\n", errno, strerror(errno));
+    close(fdAccept);
+    return EXIT_FAILURE;
+  }
+
+  if (listen(fdAccept, SOMAXCONN) == -1) {
+    printf("failed to listen(errno:%d, error_str:%s)\n", errno,
+           strerror(errno));
+    close(fdAccept);
+    return EXIT_FAILURE;
+  }
+
+  printf("replay server listening on port %d, capacity %d, budget %lld\n",
+         options.port, options.capacity, (long long)options.budgetBytes);
+
+  while (1) {
+    auto fd = accept(fdAccept, nullptr, nullptr);
+    if (fd == -1) {
+      printf("failed to accept(errno:%d, error_str:%s)\n", errno,
+             strerror(errno));
+      continue;
+    }
+    std::thread(serveConnection, fd, std::ref(replay)).detach();
+  }
+
+  return EXIT_SUCCESS;
+}